@@ -10,21 +10,51 @@ TARGET = QtCPP-Installer
 # ---- Source and Header Files ----
 SOURCES += \
     downloadmanager.cpp \
+    installengine.cpp \
+    manifest.cpp \
+    storageprobe.cpp \
+    stagedinstall.cpp \
+    payloadcache.cpp \
+    tracer.cpp \
+    lowimpact.cpp \
+    pagecache.cpp \
+    uimonitor.cpp \
+    canceltoken.cpp \
+    memorybudget.cpp \
     main.cpp \
     mainwindow.cpp
 
 HEADERS += \
     downloadmanager.h \
-    mainwindow.h
+    installengine.h \
+    manifest.h \
+    storageprobe.h \
+    stagedinstall.h \
+    payloadcache.h \
+    tracer.h \
+    lowimpact.h \
+    pagecache.h \
+    uimonitor.h \
+    canceltoken.h \
+    memorybudget.h \
+    mainwindow.h \
+    utils.h
 
 FORMS += \
     mainwindow.ui
 
-RESOURCES += resources/resources.qrc
-
 RESOURCES += \
     resources/resources.qrc
 
+win32: RESOURCES += resources/codec_windows.qrc
+unix: RESOURCES += resources/codec_linux.qrc
+
+# ---- External payload resource (registered at runtime) ----
+payload_rcc.target = payload.rcc
+payload_rcc.commands = $$[QT_HOST_LIBEXECS]/rcc -binary $$PWD/resources/payload.qrc -o $$OUT_PWD/payload.rcc
+QMAKE_EXTRA_TARGETS += payload_rcc
+PRE_TARGETDEPS += payload.rcc
+
 # ---- Include Paths ----
 INCLUDEPATH += D:/GitHub/bit7z/include
 INCLUDEPATH += D:/GitHub/vcpkg/packages/curl_x64-windows/include
@@ -33,6 +63,9 @@ INCLUDEPATH += D:/GitHub/vcpkg/packages/curl_x64-windows/include
 LIBS += -LD:/GitHub/bit7z/lib/x64/Debug -lbit7z -loleaut32
 LIBS += D:/GitHub/vcpkg/packages/curl_x64-windows/lib/libcurl.lib
 
+# ---- Fault injection (SCRUTANET_NET_IMPAIR), debug builds only ----
+CONFIG(debug, debug|release): DEFINES += SCRUTANET_FAULT_INJECTION
+
 # ---- Windows Target ----
 DEFINES += _WIN32_WINNT=0x0601
 
@@ -0,0 +1,60 @@
+#include "canceltoken.h"
+#include "tracer.h"
+#include <QDebug>
+#include <chrono>
+
+void CancelToken::cancel() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_canceled.load())
+            return;
+        m_canceledAt.start();
+        m_canceled.store(true);
+    }
+    m_wake.notify_all();
+    if (Tracer::isEnabled())
+        Tracer::instance().instant("cancel", "cancel");
+}
+
+void CancelToken::setPaused(bool paused) {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_paused.store(paused);
+    }
+    m_wake.notify_all();
+}
+
+bool CancelToken::waitWhilePaused() {
+    if (!isPaused())
+        return !isCanceled();
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_wake.wait(lock, [this]() { return !m_paused.load() || m_canceled.load(); });
+    return !m_canceled.load();
+}
+
+bool CancelToken::sleepFor(qint64 ms) {
+    if (ms <= 0)
+        return !isCanceled();
+    std::unique_lock<std::mutex> lock(m_mutex);
+    return !m_wake.wait_for(lock, std::chrono::milliseconds(ms), [this]() { return m_canceled.load(); });
+}
+
+void CancelToken::acknowledge(const QString &where) {
+    qint64 elapsed;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!m_canceledAt.isValid())
+            return;
+        elapsed = m_canceledAt.elapsed();
+    }
+    qint64 slowest = m_latencyMs.load();
+    while (elapsed > slowest && !m_latencyMs.compare_exchange_weak(slowest, elapsed)) {
+    }
+
+    if (elapsed > boundMs)
+        qWarning() << "Cancel reached" << where << "after" << elapsed << "ms, over the" << boundMs << "ms bound";
+    else
+        qDebug() << "Cancel reached" << where << "after" << elapsed << "ms";
+    if (Tracer::isEnabled())
+        Tracer::instance().instant("cancel", where, {{"latencyMs", elapsed}});
+}
@@ -0,0 +1,44 @@
+#ifndef CANCELTOKEN_H
+#define CANCELTOKEN_H
+
+#include <QString>
+#include <QElapsedTimer>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+
+// Cancel and pause for everything working on one install: downloads,
+// extraction callbacks and every wait in between. Waits go through the
+// token, so cancel() wakes them at once instead of on their next poll, and
+// each worker notices a cancel within boundMs wherever it is.
+class CancelToken {
+public:
+    static constexpr qint64 boundMs = 1000;
+
+    void cancel();
+    bool isCanceled() const { return m_canceled.load(std::memory_order_relaxed); }
+
+    void setPaused(bool paused);
+    bool isPaused() const { return m_paused.load(std::memory_order_relaxed); }
+
+    // Blocks while paused; false once canceled
+    bool waitWhilePaused();
+    // Sleeps for ms unless canceled first; false if canceled
+    bool sleepFor(qint64 ms);
+
+    // A worker stopped because of the token: logs how long after cancel()
+    // that was and warns when it took longer than boundMs
+    void acknowledge(const QString &where);
+    // Slowest acknowledge() so far in ms, -1 before the first
+    qint64 latencyMs() const { return m_latencyMs.load(); }
+
+private:
+    std::atomic<bool> m_canceled{false};
+    std::atomic<bool> m_paused{false};
+    std::atomic<qint64> m_latencyMs{-1};
+    std::mutex m_mutex;
+    std::condition_variable m_wake;
+    QElapsedTimer m_canceledAt;     // guarded by m_mutex
+};
+
+#endif // CANCELTOKEN_H
@@ -1,36 +1,270 @@
 #include "downloadmanager.h"
+#include "tracer.h"
+#include "lowimpact.h"
+#include "pagecache.h"
 #include <QFileInfo>
-#include <QThread>
+#include <QFile>
+#include <QUrl>
+#include <QRandomGenerator>
+#include <QPair>
 #include <QDebug>
 
-DownloadManager::DownloadManager(const QString &url, const QString &filePath, DownloadControlFlags* controlFlags, QObject *parent)
+#ifdef _WIN32
+#define fseeko _fseeki64
+#define ftello _ftelli64
+#endif
+
+#ifdef _WIN32
+#include <io.h>    // for _chsize_s
+#else
+#include <unistd.h> // for ftruncate
+#endif
+
+#ifdef Q_OS_LINUX
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#include <cerrno>
+#endif
+
+// Consecutive failures without progress before giving up
+static const int maxTransferRetries = 5;
+// A connection that delivers less than stallMinBytes in stallTimeoutMs is
+// treated as dead and reopened
+static const qint64 stallTimeoutMs = 15000;
+static const qint64 stallMinBytes = 16 * 1024;
+static const long connectTimeoutSec = 15;
+// Longest curl goes without checking the cancel token
+static const int cancelPollMs = 100;
+// How often the writer hands finished data to WriteBehind
+static const qint64 writeBehindStep = 4 * 1024 * 1024;
+
+std::atomic<bool> DownloadManager::s_directIo{false};
+
+bool NetworkImpairment::enabled() const {
+    return latencyMs > 0 || rateBytesPerSec > 0 || dropPerMiB > 0 || truncate > 0 || stall > 0 || ignoreRange;
+}
+
+NetworkImpairment NetworkImpairment::fromEnvironment() {
+    NetworkImpairment impairment;
+#ifdef SCRUTANET_FAULT_INJECTION
+    const QStringList settings = qEnvironmentVariable("SCRUTANET_NET_IMPAIR").split(',', Qt::SkipEmptyParts);
+    for (const QString &setting : settings) {
+        QString key = setting.section('=', 0, 0).trimmed();
+        QString value = setting.section('=', 1).trimmed();
+        if (key == "latency")
+            impairment.latencyMs = value.toInt();
+        else if (key == "rate")
+            impairment.rateBytesPerSec = value.toLongLong();
+        else if (key == "drop")
+            impairment.dropPerMiB = value.toDouble();
+        else if (key == "truncate")
+            impairment.truncate = value.toDouble();
+        else if (key == "stall")
+            impairment.stall = value.toDouble();
+        else if (key == "ignore-range")
+            impairment.ignoreRange = value != "0";
+        else
+            qWarning() << "SCRUTANET_NET_IMPAIR: unknown setting" << key;
+    }
+#else
+    if (qEnvironmentVariableIsSet("SCRUTANET_NET_IMPAIR"))
+        qWarning() << "SCRUTANET_NET_IMPAIR is ignored, this build has no fault injection";
+#endif
+    return impairment;
+}
+
+DownloadManager::DownloadManager(const QString &url, const QString &filePath, std::shared_ptr<CancelToken> token, QObject *parent)
     : QObject(parent),
     m_url(url),
     m_filePath(filePath),
     m_metaPath(filePath + ".meta"),
-    m_curl(nullptr),
+    m_impairment(NetworkImpairment::fromEnvironment()),
     m_file(nullptr),
-    m_controlFlags(controlFlags) {
-    curl_global_init(CURL_GLOBAL_ALL);
+    m_curl(nullptr),
+    m_token(token ? std::move(token) : std::make_shared<CancelToken>()) {
 }
 
 DownloadManager::~DownloadManager() {
     if (m_curl) {
         curl_easy_cleanup(m_curl);
     }
-    curl_global_cleanup();
 }
 
-qint64 DownloadManager::getRemoteFileSize() {
+void DownloadManager::setExpectedTotal(qint64 total) {
+    m_expectedTotal = total;
+}
+
+void DownloadManager::setBufferSize(qint64 bytes) {
+    m_bufferSize = bytes;
+}
+
+void DownloadManager::setDirectIo(bool enabled) {
+    s_directIo.store(enabled);
+}
+
+void DownloadManager::setRateLimit(qint64 bytesPerSec) {
+    m_rateLimit.store(bytesPerSec, std::memory_order_relaxed);
+}
+
+bool DownloadManager::succeeded() const {
+    return m_succeeded.load();
+}
+
+DownloadStats DownloadManager::stats() const {
+    return m_stats;
+}
+
+QString DownloadManager::localPath(const QString &url) {
+    QUrl parsed(url);
+    if (parsed.isLocalFile())
+        return parsed.toLocalFile();
+    // Plain paths, also C:\... which QUrl takes for a scheme
+    if (QFileInfo(url).isAbsolute() && !url.contains("://"))
+        return url;
+    return QString();
+}
+
+// Same contract as a curl transfer: appends to m_filePath from resumePos and
+// reports through progressCallback, which also handles pause, stop and rate.
+CURLcode DownloadManager::copyLocal(const QString &source, qint64 resumePos) {
+    TraceScope trace("download", "copy", source);
+    const qint64 step = 8 * 1024 * 1024;
+    CURLcode res = CURLE_OK;
+
+#ifdef Q_OS_LINUX
+    int in = ::open(QFile::encodeName(source).constData(), O_RDONLY | O_CLOEXEC);
+    if (in < 0)
+        return CURLE_FILE_COULDNT_READ_FILE;
+    int out = ::open(QFile::encodeName(m_filePath).constData(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    if (out < 0 || ftruncate(out, resumePos) != 0) {
+        m_fileError = "Failed to open file for writing";
+        if (out >= 0)
+            ::close(out);
+        ::close(in);
+        return CURLE_WRITE_ERROR;
+    }
+    posix_fadvise(in, 0, 0, POSIX_FADV_SEQUENTIAL);
+    WriteBehind writeBehind(out, resumePos);
+
+    loff_t inPos = resumePos;
+    loff_t outPos = resumePos;
+    bool copyRange = true;
+    while (inPos < m_expectedTotal) {
+        if (progressCallback(this, m_expectedTotal - resumePos, inPos - resumePos, 0, 0) != 0) {
+            res = CURLE_ABORTED_BY_CALLBACK;
+            break;
+        }
+        size_t chunk = static_cast<size_t>(qMin<qint64>(step, m_expectedTotal - inPos));
+        ssize_t n;
+        if (copyRange) {
+            // Reflinks or server-side copies where the filesystems can
+            n = copy_file_range(in, &inPos, out, &outPos, chunk, 0);
+            if (n < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)) {
+                copyRange = false;
+                continue;
+            }
+        } else {
+            // Across filesystems: still no trip through user space
+            lseek(out, outPos, SEEK_SET);
+            n = sendfile(out, in, &inPos, chunk);
+            if (n > 0)
+                outPos += n;
+        }
+        if (n <= 0) {
+            res = n < 0 ? CURLE_READ_ERROR : CURLE_PARTIAL_FILE;
+            break;
+        }
+        m_attemptBytes += n;
+        writeBehind.advance(outPos);
+    }
+    writeBehind.finish();
+    ::close(out);
+    ::close(in);
+#else
+    QFile in(source);
+    QFile out(m_filePath);
+    if (!in.open(QIODevice::ReadOnly) || !in.seek(resumePos))
+        return CURLE_FILE_COULDNT_READ_FILE;
+    if (!out.open(QIODevice::ReadWrite) || !out.resize(resumePos) || !out.seek(resumePos)) {
+        m_fileError = "Failed to open file for writing";
+        return CURLE_WRITE_ERROR;
+    }
+    QByteArray buffer(static_cast<int>(qMin<qint64>(step, m_bufferSize > 0 ? m_bufferSize : step)), Qt::Uninitialized);
+    qint64 pos = resumePos;
+    while (pos < m_expectedTotal) {
+        if (progressCallback(this, m_expectedTotal - resumePos, pos - resumePos, 0, 0) != 0) {
+            res = CURLE_ABORTED_BY_CALLBACK;
+            break;
+        }
+        qint64 n = in.read(buffer.data(), qMin<qint64>(buffer.size(), m_expectedTotal - pos));
+        if (n <= 0) {
+            res = n < 0 ? CURLE_READ_ERROR : CURLE_PARTIAL_FILE;
+            break;
+        }
+        if (out.write(buffer.constData(), n) != n) {
+            res = CURLE_WRITE_ERROR;
+            break;
+        }
+        pos += n;
+        m_attemptBytes += n;
+    }
+#endif
+    return res;
+}
+
+CURLcode DownloadManager::perform(CURL *curl, const CancelToken *token) {
+    if (!token)
+        return curl_easy_perform(curl);
+    CURLM *multi = curl_multi_init();
+    if (!multi)
+        return CURLE_OUT_OF_MEMORY;
+    curl_multi_add_handle(multi, curl);
+
+    CURLcode res = CURLE_OK;
+    int running = 1;
+    while (running) {
+        CURLMcode mc = curl_multi_perform(multi, &running);
+        if (mc == CURLM_OK && running)
+            mc = curl_multi_poll(multi, nullptr, 0, cancelPollMs, nullptr);
+        if (mc != CURLM_OK) {
+            res = CURLE_RECV_ERROR;
+            break;
+        }
+        if (running && token->isCanceled()) {
+            res = CURLE_ABORTED_BY_CALLBACK;
+            break;
+        }
+    }
+    if (!running) {
+        int queued = 0;
+        while (CURLMsg *msg = curl_multi_info_read(multi, &queued)) {
+            if (msg->msg == CURLMSG_DONE)
+                res = msg->data.result;
+        }
+    }
+    curl_multi_remove_handle(multi, curl);
+    curl_multi_cleanup(multi);
+    return res;
+}
+
+qint64 DownloadManager::remoteFileSize(const QString &url, const CancelToken *token) {
+    QString local = localPath(url);
+    if (!local.isEmpty())
+        return QFileInfo::exists(local) ? QFileInfo(local).size() : -1;
+
+    TraceScope trace("download", "HEAD", url);
     CURL *curl = curl_easy_init();
     if (!curl) return -1;
 
-    curl_easy_setopt(curl, CURLOPT_URL, m_url.toStdString().c_str());
+    curl_easy_setopt(curl, CURLOPT_URL, url.toStdString().c_str());
     curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
     curl_easy_setopt(curl, CURLOPT_HEADER, 0L);
+    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
     curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, connectTimeoutSec);
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT, 30L);
 
-    CURLcode res = curl_easy_perform(curl);
+    CURLcode res = perform(curl, token);
     double fileSize = -1;
     if (res == CURLE_OK) {
         curl_easy_getinfo(curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD, &fileSize);
@@ -39,19 +273,120 @@ qint64 DownloadManager::getRemoteFileSize() {
     return static_cast<qint64>(fileSize);
 }
 
-#ifdef _WIN32
-#define fseeko _fseeki64
-#endif
+size_t DownloadManager::memoryWriteCallback(void *ptr, size_t size, size_t nmemb, void *userdata) {
+    QByteArray *data = static_cast<QByteArray *>(userdata);
+    data->append(static_cast<const char *>(ptr), static_cast<qsizetype>(size * nmemb));
+    return size * nmemb;
+}
 
-#ifdef _WIN32
-#include <io.h>    // for _chsize_s
-#else
-#include <unistd.h> // for ftruncate
-#endif
+// Stops a range request that turned into a full download
+size_t DownloadManager::rangeWriteCallback(void *ptr, size_t size, size_t nmemb, void *userdata) {
+    auto *range = static_cast<QPair<QByteArray *, qint64> *>(userdata);
+    if (range->first->size() + qint64(size * nmemb) > range->second)
+        return 0;
+    range->first->append(static_cast<const char *>(ptr), static_cast<qsizetype>(size * nmemb));
+    return size * nmemb;
+}
+
+bool DownloadManager::fetchRange(const QString &url, qint64 offset, qint64 length, QByteArray &data, QString &error,
+                                 const CancelToken *token) {
+    data.clear();
+    QString local = localPath(url);
+    if (!local.isEmpty()) {
+        QFile file(local);
+        if (!file.open(QIODevice::ReadOnly) || !file.seek(offset)) {
+            error = QString("Reading %1 failed: %2").arg(local, file.errorString());
+            return false;
+        }
+        data = file.read(length);
+        return true;
+    }
+
+    TraceScope trace("download", "range", url);
+    CURL *curl = curl_easy_init();
+    if (!curl) {
+        error = "Failed to initialize curl";
+        return false;
+    }
+
+    QPair<QByteArray *, qint64> range(&data, length);
+    QByteArray bytes = QString("%1-%2").arg(offset).arg(offset + length - 1).toLatin1();
+    curl_easy_setopt(curl, CURLOPT_URL, url.toStdString().c_str());
+    curl_easy_setopt(curl, CURLOPT_RANGE, bytes.constData());
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, rangeWriteCallback);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &range);
+    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, connectTimeoutSec);
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT, 60L);
+
+    CURLcode res = perform(curl, token);
+    long status = 0;
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+    curl_easy_cleanup(curl);
+    if (res != CURLE_OK || status != 206) {
+        error = QString("Range request to %1 failed: %2")
+                    .arg(url, res != CURLE_OK ? QString(curl_easy_strerror(res)) : QString("no range support"));
+        return false;
+    }
+    return true;
+}
+
+bool DownloadManager::fetch(const QString &url, QByteArray &data, QString &error, const CancelToken *token) {
+    QString local = localPath(url);
+    if (!local.isEmpty()) {
+        QFile file(local);
+        if (!file.open(QIODevice::ReadOnly)) {
+            error = QString("Reading %1 failed: %2").arg(local, file.errorString());
+            return false;
+        }
+        data = file.readAll();
+        return true;
+    }
+
+    CURL *curl = curl_easy_init();
+    if (!curl) {
+        error = "Failed to initialize curl";
+        return false;
+    }
+
+    data.clear();
+    curl_easy_setopt(curl, CURLOPT_URL, url.toStdString().c_str());
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, memoryWriteCallback);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &data);
+    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 5L);
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT, 15L);
+
+    CURLcode res = perform(curl, token);
+    curl_easy_cleanup(curl);
+    if (res != CURLE_OK) {
+        error = QString("Fetching %1 failed: %2").arg(url, curl_easy_strerror(res));
+        return false;
+    }
+    return true;
+}
 
 void DownloadManager::start() {
+    m_succeeded.store(false);
+    m_stats = DownloadStats();
+    m_recoveryTimer.invalidate();
+    m_fileError.clear();
+    m_attemptBytes = 0;
+    m_injectedDrop = false;
+
+    if (m_impairment.enabled())
+        qWarning() << "Network impairment active for" << m_url;
+
     // 1. Get remote file size for accurate ETA and progress
-    m_expectedTotal = getRemoteFileSize();
+    if (m_expectedTotal <= 0)
+        m_expectedTotal = remoteFileSize(m_url, m_token.get());
+    if (m_token->isCanceled()) {
+        m_token->acknowledge("download " + QFileInfo(m_filePath).fileName());
+        emit finished();
+        return;
+    }
     if (m_expectedTotal <= 0) {
         emit error("Failed to get remote file size");
         emit finished();
@@ -64,17 +399,217 @@ void DownloadManager::start() {
     QFileInfo fi(m_filePath);
     qint64 actualSize = fi.exists() ? fi.size() : 0;
     qint64 resumePos = qMin(metaResume, actualSize);
-    m_resumeBase = resumePos; // For correct progress calculation
 
     qDebug() << "Resuming from" << resumePos << "of" << m_expectedTotal;
 
-    // 3. Open file for resume or fresh download
+    // 3. Transfer, picking up from what reached the disk after every failure
+    CURLcode res = CURLE_OK;
+    qint64 onDisk = resumePos;
+    int attempt = 0;
+    for (;;) {
+        if (resumePos == m_expectedTotal) {
+            // Everything arrived before the last run could clean up
+            res = CURLE_OK;
+        } else {
+            res = transfer(resumePos);
+        }
+        if (!m_fileError.isEmpty()) {
+            emit error(m_fileError);
+            emit finished();
+            return;
+        }
+        QFileInfo written(m_filePath);
+        written.refresh();
+        onDisk = written.exists() ? written.size() : 0;
+        if (m_token->isCanceled())
+            break;
+        if (res == CURLE_OK && onDisk == m_expectedTotal)
+            break;
+        // The server said it was done but the file disagrees
+        if (res == CURLE_OK)
+            res = CURLE_PARTIAL_FILE;
+#ifdef SCRUTANET_FAULT_INJECTION
+        if (m_injectedDrop)
+            res = CURLE_RECV_ERROR;
+#endif
+        if (m_stalled) {
+            res = CURLE_OPERATION_TIMEDOUT;
+            m_stats.stalls++;
+            m_stats.stalledMs += stallTimeoutMs;
+        }
+        // Only failures in a row count; a long download on a flaky link
+        // keeps going as long as each attempt gets somewhere
+        attempt = onDisk > resumePos ? 1 : attempt + 1;
+        if (!isTransient(res) || attempt > maxTransferRetries)
+            break;
+
+        // A server without range support, or a file longer than it should
+        // be, means starting over; otherwise continue where the disk ends
+        qint64 next = (res == CURLE_RANGE_ERROR || onDisk > m_expectedTotal) ? 0 : onDisk;
+        m_stats.failures++;
+        m_stats.wastedBytes += qMax<qint64>(0, m_attemptBytes - (onDisk - qMin(resumePos, onDisk)));
+        if (next == 0)
+            m_stats.wastedBytes += onDisk;
+        m_recoveryTimer.start();
+
+        // Jittered, so parallel downloads hit by the same blip do not
+        // all reconnect at the same moment
+        qint64 delay = qMin(500 << (attempt - 1), 8000);
+        delay = delay / 2 + QRandomGenerator::global()->bounded(delay / 2 + 1);
+        QString reason = m_stalled ? QString("stalled") : QString(curl_easy_strerror(res));
+        qWarning() << "Download of" << m_url << "interrupted at" << onDisk << "of" << m_expectedTotal
+                   << ":" << reason << "- retrying from" << next << "in" << delay << "ms";
+        emit retrying(m_stats.failures, delay, reason);
+        resumePos = next;
+        if (!backOff(delay))
+            break;
+    }
+
+    if (m_stats.failures > 0) {
+        qDebug() << "Download of" << m_url << ":" << m_stats.failures << "failures," << m_stats.stalls << "stalls,"
+                 << m_stats.wastedBytes << "bytes wasted,"
+                 << m_stats.recoveryMs + m_stats.stalledMs << "ms lost";
+    }
+
+    // 4. Finalize
+    if (res == CURLE_OK && onDisk == m_expectedTotal && !m_token->isCanceled()) {
+        deleteMetaFile(); // Remove resume data if success
+        m_succeeded.store(true);
+        emit finished();
+    } else if (m_token->isCanceled()) {
+        // The file is closed; record exactly what reached it so the next
+        // run resumes from there
+        saveMetaFile(qMin(onDisk, m_expectedTotal));
+        m_token->acknowledge("download " + QFileInfo(m_filePath).fileName());
+        emit finished();
+    } else {
+        emit error(QString("Download failed: %1").arg(curl_easy_strerror(res)));
+        emit finished();
+    }
+}
+
+CURLcode DownloadManager::transfer(qint64 resumePos) {
+    m_resumeBase = resumePos; // For correct progress calculation
+    m_attemptBytes = 0;
+    m_attemptTimer.start();
+    // curl counts from 0 again on every request
+    m_speedTimer.start();
+    m_lastBytes = 0;
+    m_injectedDrop = false;
+    m_fileError.clear();
+    m_truncateAt = -1;
+    m_stallAt = -1;
+    m_stalled = false;
+    m_stallTimer.invalidate();
+    m_stallBytes = 0;
+
+#ifdef SCRUTANET_FAULT_INJECTION
+    if (m_impairment.latencyMs > 0 && !m_token->sleepFor(m_impairment.latencyMs))
+        return CURLE_ABORTED_BY_CALLBACK;
+    if (resumePos > 0 && m_impairment.ignoreRange) {
+        // What libcurl reports when a server answers a range request with 200
+        return CURLE_RANGE_ERROR;
+    }
+#endif
+
+    QString local = localPath(m_url);
+    if (!local.isEmpty())
+        return copyLocal(local, resumePos);
+
+#ifdef SCRUTANET_FAULT_INJECTION
+    if (m_impairment.truncate > 0 && QRandomGenerator::global()->generateDouble() < m_impairment.truncate)
+        m_truncateAt = QRandomGenerator::global()->bounded(qMax<qint64>(1, m_expectedTotal - resumePos));
+    if (m_impairment.stall > 0 && QRandomGenerator::global()->generateDouble() < m_impairment.stall)
+        m_stallAt = QRandomGenerator::global()->bounded(qMax<qint64>(1, m_expectedTotal - resumePos));
+#endif
+
+    if (!openOutput(resumePos))
+        return CURLE_WRITE_ERROR;
+
+    m_curl = curl_easy_init();
+    if (!m_curl) {
+        m_fileError = "Failed to initialize curl";
+        closeOutput();
+        return CURLE_FAILED_INIT;
+    }
+
+    curl_easy_setopt(m_curl, CURLOPT_URL, m_url.toStdString().c_str());
+    curl_easy_setopt(m_curl, CURLOPT_WRITEDATA, this);
+    curl_easy_setopt(m_curl, CURLOPT_WRITEFUNCTION, writeCallback);
+    curl_easy_setopt(m_curl, CURLOPT_NOPROGRESS, 0L);
+    curl_easy_setopt(m_curl, CURLOPT_XFERINFOFUNCTION, progressCallback);
+    curl_easy_setopt(m_curl, CURLOPT_XFERINFODATA, this);
+    curl_easy_setopt(m_curl, CURLOPT_FOLLOWLOCATION, 1L);
+    // An error page must never end up in the payload
+    curl_easy_setopt(m_curl, CURLOPT_FAILONERROR, 1L);
+    // Dead connections are caught by the stall check in progressCallback;
+    // these cover the handshake and idle NAT timeouts
+    curl_easy_setopt(m_curl, CURLOPT_CONNECTTIMEOUT, connectTimeoutSec);
+    curl_easy_setopt(m_curl, CURLOPT_TCP_KEEPALIVE, 1L);
+    if (m_bufferSize > 0) {
+        curl_easy_setopt(m_curl, CURLOPT_BUFFERSIZE, static_cast<long>(qMin<qint64>(m_bufferSize, CURL_MAX_READ_SIZE)));
+    }
+#ifdef SCRUTANET_FAULT_INJECTION
+    if (m_impairment.rateBytesPerSec > 0) {
+        curl_easy_setopt(m_curl, CURLOPT_MAX_RECV_SPEED_LARGE, (curl_off_t)m_impairment.rateBytesPerSec);
+    }
+#endif
+
+    if (resumePos > 0) {
+        curl_easy_setopt(m_curl, CURLOPT_RESUME_FROM_LARGE, (curl_off_t)resumePos);
+    }
+
+    qint64 traceStart = Tracer::isEnabled() ? Tracer::instance().now() : -1;
+    CURLcode res = perform(m_curl, m_token.get());
+    if (traceStart >= 0)
+        traceTransfer(traceStart, resumePos, res);
+
+    curl_easy_cleanup(m_curl);
+    m_curl = nullptr;
+    if (!closeOutput() && res == CURLE_OK)
+        res = CURLE_WRITE_ERROR;
+    return res;
+}
+
+// Splits one request into the phases curl timed for us
+void DownloadManager::traceTransfer(qint64 startUs, qint64 resumePos, CURLcode res) {
+    curl_off_t dns = 0, connect = 0, tls = 0, firstByte = 0, total = 0;
+    curl_easy_getinfo(m_curl, CURLINFO_NAMELOOKUP_TIME_T, &dns);
+    curl_easy_getinfo(m_curl, CURLINFO_CONNECT_TIME_T, &connect);
+    curl_easy_getinfo(m_curl, CURLINFO_APPCONNECT_TIME_T, &tls);
+    curl_easy_getinfo(m_curl, CURLINFO_STARTTRANSFER_TIME_T, &firstByte);
+    curl_easy_getinfo(m_curl, CURLINFO_TOTAL_TIME_T, &total);
+
+    Tracer &tracer = Tracer::instance();
+    QString file = QFileInfo(m_filePath).fileName();
+    tracer.complete("download", "request " + file, startUs, total,
+                    {{"url", m_url}, {"from", resumePos}, {"bytes", m_attemptBytes},
+                     {"result", QString(curl_easy_strerror(res))}});
+    tracer.complete("download", "dns", startUs, dns);
+    tracer.complete("download", "connect", startUs + dns, connect - dns);
+    if (tls > 0)
+        tracer.complete("download", "tls", startUs + connect, tls - connect);
+    qint64 ready = qMax(connect, tls);
+    tracer.complete("download", "wait", startUs + ready, firstByte - ready);
+    tracer.complete("download", "transfer", startUs + firstByte, total - firstByte);
+}
+
+bool DownloadManager::openOutput(qint64 resumePos) {
+    // O_DIRECT keeps the payload out of the page cache altogether
+    if (s_directIo.load(std::memory_order_relaxed)) {
+        m_direct = std::make_unique<DirectFileWriter>();
+        if (m_direct->open(m_filePath, resumePos))
+            return true;
+        qDebug() << "O_DIRECT not available for" << m_filePath << "- using buffered writes";
+        m_direct.reset();
+    }
+
+    // Open file for resume or fresh download
     if (resumePos > 0) {
         m_file = fopen(m_filePath.toStdString().c_str(), "r+b");
         if (!m_file) {
-            emit error("Cannot open file for resuming");
-            emit finished();
-            return;
+            m_fileError = "Cannot open file for resuming";
+            return false;
         }
 
         // Seek to resume point
@@ -84,10 +619,10 @@ void DownloadManager::start() {
         if (fseeko(m_file, resumePos, SEEK_SET) != 0)
 #endif
         {
-            emit error("Failed to seek in file");
+            m_fileError = "Failed to seek in file";
             fclose(m_file);
-            emit finished();
-            return;
+            m_file = nullptr;
+            return false;
         }
 
         // Truncate any extra bytes after resume position
@@ -101,70 +636,112 @@ void DownloadManager::start() {
         // Fresh download: overwrite file
         m_file = fopen(m_filePath.toStdString().c_str(), "wb");
         if (!m_file) {
-            emit error("Cannot open file for writing");
-            emit finished();
-            return;
+            m_fileError = "Cannot open file for writing";
+            return false;
         }
     }
 
-    // 4. Initialize CURL
-    m_curl = curl_easy_init();
-    if (!m_curl) {
-        emit error("Failed to initialize curl");
-        fclose(m_file);
-        emit finished();
-        return;
+    // Larger buffers mean fewer, bigger writes, which slow disks prefer
+    if (m_bufferSize > 0) {
+        setvbuf(m_file, nullptr, _IOFBF, static_cast<size_t>(m_bufferSize));
     }
 
-    curl_easy_setopt(m_curl, CURLOPT_URL, m_url.toStdString().c_str());
-    curl_easy_setopt(m_curl, CURLOPT_WRITEDATA, m_file);
-    curl_easy_setopt(m_curl, CURLOPT_WRITEFUNCTION, writeCallback);
-    curl_easy_setopt(m_curl, CURLOPT_NOPROGRESS, 0L);
-    curl_easy_setopt(m_curl, CURLOPT_XFERINFOFUNCTION, progressCallback);
-    curl_easy_setopt(m_curl, CURLOPT_XFERINFODATA, this);
-    curl_easy_setopt(m_curl, CURLOPT_FOLLOWLOCATION, 1L);
+    // Written data is flushed and dropped from the cache as we go
+    m_writeBehind = std::make_unique<WriteBehind>(fileno(m_file), resumePos);
+    m_nextWriteBehind = writeBehindStep;
+    return true;
+}
 
-    if (resumePos > 0) {
-        curl_easy_setopt(m_curl, CURLOPT_RESUME_FROM_LARGE, (curl_off_t)resumePos);
+bool DownloadManager::closeOutput() {
+    bool ok = true;
+    if (m_direct) {
+        ok = m_direct->close();
+        m_direct.reset();
     }
+    if (m_file) {
+        ok = fflush(m_file) == 0 && ok;
+        if (m_writeBehind)
+            m_writeBehind->finish();
+        ok = fclose(m_file) == 0 && ok;
+        m_file = nullptr;
+    }
+    m_writeBehind.reset();
+    return ok;
+}
 
-    // 5. Perform download
-    CURLcode res = curl_easy_perform(m_curl);
-
-    // 6. Cleanup
-    curl_easy_cleanup(m_curl);
-    fclose(m_file);
-
-    // 7. Finalize
-    if (res == CURLE_OK && !m_stopRequested.load()) {
-        deleteMetaFile(); // Remove resume data if success
-        emit finished();
-    } else if (m_stopRequested.load()) {
-        QThread::msleep(100); // Cancel requested
-    } else {
-        emit error(QString("Download failed: %1").arg(curl_easy_strerror(res)));
-        emit finished();
+bool DownloadManager::isTransient(CURLcode res) {
+    switch (res) {
+    case CURLE_PARTIAL_FILE:
+    case CURLE_RECV_ERROR:
+    case CURLE_SEND_ERROR:
+    case CURLE_GOT_NOTHING:
+    case CURLE_OPERATION_TIMEDOUT:
+    case CURLE_COULDNT_CONNECT:
+    case CURLE_COULDNT_RESOLVE_HOST:
+    case CURLE_RANGE_ERROR:
+    case CURLE_HTTP2:
+    case CURLE_HTTP2_STREAM:
+        return true;
+    default:
+        return false;
     }
 }
 
+bool DownloadManager::backOff(qint64 ms) {
+    return m_token->sleepFor(ms);
+}
+
 void DownloadManager::pause() {
-    if (m_controlFlags)
-        m_controlFlags->paused.store(true, std::memory_order_relaxed);
+    m_token->setPaused(true);
 }
 
 void DownloadManager::resume() {
-    if (m_controlFlags)
-        m_controlFlags->paused.store(false, std::memory_order_relaxed);
+    m_token->setPaused(false);
 }
 
 void DownloadManager::cancel() {
-    if (m_controlFlags)
-        m_controlFlags->stopped.store(true, std::memory_order_relaxed);
+    m_token->cancel();
 }
 
 size_t DownloadManager::writeCallback(void *ptr, size_t size, size_t nmemb, void *userdata) {
-    FILE *stream = (FILE *)userdata;
-    return fwrite(ptr, size, nmemb, stream);
+    DownloadManager *self = static_cast<DownloadManager *>(userdata);
+    size_t bytes = size * nmemb;
+
+#ifdef SCRUTANET_FAULT_INJECTION
+    // Injected stall: hold the data back, curl hands it to us again on resume
+    if (self->m_stallAt >= 0 && self->m_attemptBytes + static_cast<qint64>(bytes) > self->m_stallAt)
+        return CURL_WRITEFUNC_PAUSE;
+#endif
+
+    if (self->m_recoveryTimer.isValid()) {
+        self->m_stats.recoveryMs += self->m_recoveryTimer.elapsed();
+        self->m_recoveryTimer.invalidate();
+    }
+    self->m_attemptBytes += static_cast<qint64>(bytes);
+
+#ifdef SCRUTANET_FAULT_INJECTION
+    const NetworkImpairment &impairment = self->m_impairment;
+    if (impairment.dropPerMiB > 0
+        && QRandomGenerator::global()->generateDouble() < impairment.dropPerMiB * bytes / (1024.0 * 1024.0)) {
+        self->m_injectedDrop = true;
+        return 0; // aborts the transfer like a reset connection
+    }
+    if (self->m_truncateAt >= 0 && self->m_attemptBytes > self->m_truncateAt) {
+        // Swallow the rest so the transfer ends "successfully" but short
+        return bytes;
+    }
+#endif
+
+    if (self->m_direct)
+        return self->m_direct->write(static_cast<const char *>(ptr), static_cast<qint64>(bytes)) ? bytes : 0;
+
+    size_t written = fwrite(ptr, size, nmemb, self->m_file) * size;
+    if (self->m_writeBehind && self->m_attemptBytes >= self->m_nextWriteBehind) {
+        fflush(self->m_file);
+        self->m_writeBehind->advance(ftello(self->m_file));
+        self->m_nextWriteBehind = self->m_attemptBytes + writeBehindStep;
+    }
+    return written;
 }
 
 int DownloadManager::progressCallback(void *clientp, curl_off_t dltotal, curl_off_t dlnow,
@@ -176,18 +753,47 @@ int DownloadManager::progressCallback(void *clientp, curl_off_t dltotal, curl_of
     self->saveMetaFile(totalDownloaded);
 
     // Stop if cancel requested
-    if (self->m_controlFlags && self->m_controlFlags->stopped.load(std::memory_order_relaxed)) {
+    if (self->m_token->isCanceled())
         return 1; // abort download
+
+    // Stall check: curl calls this about once a second even when nothing
+    // arrives, so a quiet connection is noticed here and reopened by start()
+    if (!self->m_stallTimer.isValid() || dlnow - self->m_stallBytes >= stallMinBytes) {
+        self->m_stallTimer.start();
+        self->m_stallBytes = dlnow;
+    } else if (self->m_stallTimer.elapsed() > stallTimeoutMs) {
+        self->m_stalled = true;
+        return 1;
     }
 
-    // Pause logic: block thread without eating CPU
-    while (self->m_controlFlags && self->m_controlFlags->paused.load(std::memory_order_relaxed)) {
-        QThread::msleep(200);
+    QElapsedTimer held;
+    held.start();
+
+    // Pause logic: block thread without eating CPU, a cancel wakes it
+    if (!self->m_token->waitWhilePaused())
+        return 1;
+
+    // Low-impact mode: give the host's own workload room first
+    const CancelToken *token = self->m_token.get();
+    LowImpact::waitWhileBusy([token]() { return token->isCanceled(); });
+
+    // Time we held the transfer ourselves is not the connection's fault
+    if (held.elapsed() > 1000)
+        self->m_stallTimer.start();
+
+    // Rate limit: hold back until the average is under the cap again. Short
+    // naps, so lifting the limit or stopping is noticed quickly.
+    qint64 limit = self->m_rateLimit.load(std::memory_order_relaxed);
+    if (limit > 0 && dlnow > 0) {
+        qint64 dueMs = dlnow * 1000 / limit;
+        qint64 aheadMs = dueMs - self->m_attemptTimer.elapsed();
+        if (aheadMs > 0 && !self->m_token->sleepFor(qMin<qint64>(aheadMs, 200)))
+            return 1;
     }
 
     // Progress reporting every second
-    static QElapsedTimer timer;
-    static curl_off_t lastBytes = 0;
+    QElapsedTimer &timer = self->m_speedTimer;
+    curl_off_t &lastBytes = self->m_lastBytes;
 
     if (!timer.isValid())
         timer.start();
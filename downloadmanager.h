@@ -6,16 +6,43 @@
 #include <atomic>
 #include <QElapsedTimer>
 #include <curl/curl.h>
+#include <memory>
+#include "pagecache.h"
+#include "canceltoken.h"
 
-struct DownloadControlFlags {
-    std::atomic<bool> paused{false};
-    std::atomic<bool> stopped{false};
+// Client-side stand-in for a bad network, for exercising the resume path by
+// hand or in CI. Read from SCRUTANET_NET_IMPAIR, e.g.
+//   latency=300,rate=262144,drop=0.2,truncate=0.1,stall=0.1,ignore-range=1
+// drop is the chance per MiB that the connection breaks, truncate the chance
+// per request that the body ends early but the transfer still looks complete,
+// stall the chance per request that data stops arriving on an open connection.
+// Only debug builds (SCRUTANET_FAULT_INJECTION) act on it; release builds
+// ignore the variable.
+struct NetworkImpairment {
+    int latencyMs = 0;
+    qint64 rateBytesPerSec = 0;
+    double dropPerMiB = 0;
+    double truncate = 0;
+    double stall = 0;
+    bool ignoreRange = false;
+
+    bool enabled() const;
+    static NetworkImpairment fromEnvironment();
+};
+
+// How much a download lost to failures
+struct DownloadStats {
+    int failures = 0;
+    int stalls = 0;             // failures where the connection went quiet
+    qint64 wastedBytes = 0;     // received but not kept
+    qint64 recoveryMs = 0;      // from failure to the next byte received, summed
+    qint64 stalledMs = 0;       // spent waiting on stalled connections
 };
 
 class DownloadManager : public QObject {
     Q_OBJECT
 public:
-    explicit DownloadManager(const QString &url, const QString &filePath, DownloadControlFlags* controlFlags, QObject *parent = nullptr);
+    explicit DownloadManager(const QString &url, const QString &filePath, std::shared_ptr<CancelToken> token, QObject *parent = nullptr);
     ~DownloadManager();
 
     void start();
@@ -23,20 +50,62 @@ public:
     void resume();
     void cancel();
 
+    // Known size of the remote file; skips the HEAD request in start()
+    void setExpectedTotal(qint64 total);
+    // Write buffer size, tuned to the target storage
+    void setBufferSize(qint64 bytes);
+    // Caps the transfer rate, 0 for none. Takes effect immediately, also
+    // while a transfer is running.
+    void setRateLimit(qint64 bytesPerSec);
+    // Write payloads with O_DIRECT where the filesystem allows it
+    static void setDirectIo(bool enabled);
+    bool succeeded() const;
+    DownloadStats stats() const;
+
+    // The blocking helpers below return within CancelToken::boundMs of a
+    // cancel on token, when one is given
+    static qint64 remoteFileSize(const QString &url, const CancelToken *token = nullptr);
+    // Small blocking GET into memory, e.g. for the manifest
+    static bool fetch(const QString &url, QByteArray &data, QString &error, const CancelToken *token = nullptr);
+    // length bytes from offset with a range request. Fails rather than
+    // downloading the whole file from a server without range support.
+    static bool fetchRange(const QString &url, qint64 offset, qint64 length, QByteArray &data, QString &error,
+                           const CancelToken *token = nullptr);
+    // The file a file:// URL or absolute path names, empty for network URLs.
+    // Those are copied in the kernel instead of going through libcurl.
+    static QString localPath(const QString &url);
+
 signals:
     void progress(qint64 downloaded, qint64 total, double speedMBps, int eta);
     void finished();
     void error(const QString &msg);
+    // A transfer failed and is retried after delayMs
+    void retrying(int failures, qint64 delayMs, const QString &reason);
 
 private:
     static size_t writeCallback(void *ptr, size_t size, size_t nmemb, void *userdata);
+    static size_t memoryWriteCallback(void *ptr, size_t size, size_t nmemb, void *userdata);
+    static size_t rangeWriteCallback(void *ptr, size_t size, size_t nmemb, void *userdata);
     static int progressCallback(void *clientp, curl_off_t dltotal, curl_off_t dlnow,
                                 curl_off_t ultotal, curl_off_t ulnow);
 
+    // curl_easy_perform(), but checks token between short polls; on its own
+    // curl only calls back about once a second on a quiet connection
+    static CURLcode perform(CURL *curl, const CancelToken *token);
+    // One request from resumePos to the end; the file is closed afterwards
+    CURLcode transfer(qint64 resumePos);
+    // transfer() for local sources: copy_file_range, then sendfile, then read/write
+    CURLcode copyLocal(const QString &source, qint64 resumePos);
+    void traceTransfer(qint64 startUs, qint64 resumePos, CURLcode res);
+    bool openOutput(qint64 resumePos);
+    bool closeOutput();
+    static bool isTransient(CURLcode res);
+    // Waits out a retry delay; false if canceled meanwhile
+    bool backOff(qint64 ms);
+
     bool saveMetaFile(qint64 downloaded);
     bool loadMetaFile(qint64 &downloaded);
     void deleteMetaFile();
-    qint64 getRemoteFileSize();
 
     QString m_url;
     QString m_filePath;
@@ -44,15 +113,39 @@ private:
 
     qint64 m_resumeBase = 0;         // Base offset when resuming
     qint64 m_expectedTotal = 0;      // Full file size
+    qint64 m_bufferSize = 0;         // 0 keeps the stdio/curl defaults
+
+    // Current attempt, for retries and the stats
+    qint64 m_attemptBytes = 0;
+    QElapsedTimer m_attemptTimer;
+    std::atomic<qint64> m_rateLimit{0};
+    qint64 m_truncateAt = -1;
+    qint64 m_stallAt = -1;
+    bool m_injectedDrop = false;
+    // Stall detection: too few bytes since m_stallTimer started
+    QElapsedTimer m_stallTimer;
+    curl_off_t m_stallBytes = 0;
+    bool m_stalled = false;
+    QString m_fileError;
+    QElapsedTimer m_recoveryTimer;
+    DownloadStats m_stats;
+    NetworkImpairment m_impairment;
+
+    // Per-transfer speed sampling, several downloads may run at once
+    QElapsedTimer m_speedTimer;
+    curl_off_t m_lastBytes = 0;
 
     FILE *m_file;
+    std::unique_ptr<DirectFileWriter> m_direct;
+    std::unique_ptr<WriteBehind> m_writeBehind;
+    qint64 m_nextWriteBehind = 0;
+    static std::atomic<bool> s_directIo;
     CURL *m_curl;
 
-    DownloadControlFlags* m_controlFlags;
+    // Shared with the install's other workers; pause and cancel go through it
+    std::shared_ptr<CancelToken> m_token;
 
-    std::atomic<bool> m_paused{false};
-    std::atomic<bool> m_stopRequested{false};
-    std::atomic<bool> m_isPausedState {false}; // in your class, initially false
+    std::atomic<bool> m_succeeded{false};
 };
 
 #endif // DOWNLOADMANAGER_H
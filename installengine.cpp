@@ -0,0 +1,306 @@
+#include "installengine.h"
+#include "tracer.h"
+#include "lowimpact.h"
+#include "uimonitor.h"
+#include <QThreadPool>
+#include <QDebug>
+#include <exception>
+
+InstallEngine::InstallEngine(QObject *parent)
+    : QObject(parent),
+    m_pool(QThreadPool::globalInstance()) {
+}
+
+InstallEngine::~InstallEngine() {
+    // Running tasks capture this engine, so they must be gone before we are.
+    // Observers may already be half destroyed, so stay quiet while stopping.
+    blockSignals(true);
+    cancel();
+    QMutexLocker locker(&m_inPoolMutex);
+    while (m_inPool > 0)
+        m_inPoolDone.wait(&m_inPoolMutex);
+}
+
+void InstallEngine::addTask(const QString &id, const QStringList &dependencies, TaskFunction work) {
+    if (m_started) {
+        qWarning() << "InstallEngine: cannot add task" << id << "after start";
+        return;
+    }
+    if (m_tasks.contains(id)) {
+        qWarning() << "InstallEngine: duplicate task" << id;
+        return;
+    }
+    Task task;
+    task.dependencies = dependencies;
+    task.work = std::move(work);
+    m_tasks.insert(id, task);
+    m_order.append(id);
+}
+
+void InstallEngine::addGate(const QString &id, const QStringList &dependencies) {
+    addTask(id, dependencies, nullptr);
+    if (m_tasks.contains(id))
+        m_tasks[id].gate = true;
+}
+
+void InstallEngine::openGate(const QString &id) {
+    auto it = m_tasks.find(id);
+    if (it == m_tasks.end() || !it->gate) {
+        qWarning() << "InstallEngine: no gate named" << id;
+        return;
+    }
+    it->gateOpen = true;
+    if (m_started)
+        scheduleReady();
+}
+
+void InstallEngine::skipTask(const QString &id) {
+    auto it = m_tasks.find(id);
+    if (it == m_tasks.end() || it->state != TaskState::Pending)
+        return;
+    markSkipped(id);
+    if (m_started)
+        scheduleReady();
+}
+
+void InstallEngine::setThreadPool(QThreadPool *pool) {
+    m_pool = pool ? pool : QThreadPool::globalInstance();
+}
+
+void InstallEngine::setGroupLimit(const QString &prefix, int limit) {
+    m_groupLimits.insert(prefix, qMax(1, limit));
+    if (m_started)
+        scheduleReady();
+}
+
+void InstallEngine::start() {
+    if (m_started)
+        return;
+
+    for (const QString &id : std::as_const(m_order)) {
+        for (const QString &dep : std::as_const(m_tasks[id].dependencies)) {
+            if (!m_tasks.contains(dep)) {
+                qWarning() << "InstallEngine: task" << id << "depends on unknown task" << dep;
+                m_failed = true;
+            }
+        }
+    }
+
+    m_started = true;
+    if (m_failed) {
+        for (const QString &id : std::as_const(m_order))
+            markSkipped(id);
+        checkFinished();
+        return;
+    }
+    scheduleReady();
+}
+
+void InstallEngine::cancel() {
+    if (m_cancelled.exchange(true))
+        return;
+    for (const QString &id : std::as_const(m_order)) {
+        if (m_tasks[id].state == TaskState::Pending)
+            markSkipped(id);
+    }
+    if (m_started)
+        checkFinished();
+}
+
+bool InstallEngine::isRunning() const {
+    return m_started && !m_finished;
+}
+
+bool InstallEngine::isCancelled() const {
+    return m_cancelled.load(std::memory_order_relaxed);
+}
+
+bool InstallEngine::hasTask(const QString &id) const {
+    return m_tasks.contains(id);
+}
+
+InstallEngine::TaskState InstallEngine::taskState(const QString &id) const {
+    auto it = m_tasks.constFind(id);
+    return it == m_tasks.constEnd() ? TaskState::Skipped : it->state;
+}
+
+qint64 InstallEngine::taskElapsedMs(const QString &id) const {
+    auto it = m_tasks.constFind(id);
+    return it == m_tasks.constEnd() ? 0 : it->elapsedMs;
+}
+
+bool InstallEngine::dependenciesDone(const Task &task) const {
+    for (const QString &dep : task.dependencies) {
+        if (m_tasks.constFind(dep)->state != TaskState::Done)
+            return false;
+    }
+    return true;
+}
+
+bool InstallEngine::groupHasCapacity(const QString &id) const {
+    for (auto limit = m_groupLimits.constBegin(); limit != m_groupLimits.constEnd(); ++limit) {
+        if (!id.startsWith(limit.key()))
+            continue;
+        int running = 0;
+        for (auto it = m_tasks.constBegin(); it != m_tasks.constEnd(); ++it) {
+            if (it->state == TaskState::Running && it.key().startsWith(limit.key()))
+                ++running;
+        }
+        if (running >= limit.value())
+            return false;
+    }
+    return true;
+}
+
+bool InstallEngine::dependencyAborted(const Task &task) const {
+    for (const QString &dep : task.dependencies) {
+        TaskState state = m_tasks.constFind(dep)->state;
+        if (state == TaskState::Failed || state == TaskState::Skipped)
+            return true;
+    }
+    return false;
+}
+
+void InstallEngine::scheduleReady() {
+    if (m_finished)
+        return;
+
+    // Observers may open gates or skip tasks from inside our signals; let the
+    // outermost call pick that up instead of recursing.
+    if (m_scheduling) {
+        m_rescheduleRequested = true;
+        return;
+    }
+    m_scheduling = true;
+
+    // Propagate failures and skips first, then launch everything runnable.
+    // Completing a gate can unblock further tasks, so loop until stable.
+    do {
+        m_rescheduleRequested = false;
+        for (const QString &id : std::as_const(m_order)) {
+            Task &task = m_tasks[id];
+            if (task.state != TaskState::Pending)
+                continue;
+
+            if (isCancelled() || dependencyAborted(task)) {
+                markSkipped(id);
+                m_rescheduleRequested = true;
+                continue;
+            }
+            if (!dependenciesDone(task))
+                continue;
+
+            if (task.gate) {
+                if (task.gateOpen) {
+                    task.state = TaskState::Done;
+                    emit taskFinished(id, 0);
+                    m_rescheduleRequested = true;
+                }
+                continue;
+            }
+            if (groupHasCapacity(id))
+                runTask(id);
+        }
+    } while (m_rescheduleRequested);
+
+    m_scheduling = false;
+    checkFinished();
+}
+
+void InstallEngine::runTask(const QString &id) {
+    Task &task = m_tasks[id];
+    task.state = TaskState::Running;
+    task.timer.start();
+    ++m_running;
+
+    TaskFunction work = task.work;
+    emit taskStarted(id);
+    {
+        QMutexLocker locker(&m_inPoolMutex);
+        ++m_inPool;
+    }
+    m_pool->start([this, id, work]() {
+        QString error;
+        bool ok = false;
+        TraceScope trace("engine", "task", id);
+        LowImpact::applyToCurrentThread();
+        try {
+            ok = work(error);
+        } catch (const std::exception &e) {
+            error = QString::fromUtf8(e.what());
+        }
+        if (!ok && error.isEmpty())
+            error = isCancelled() ? QStringLiteral("Canceled") : QStringLiteral("Task failed");
+
+        QMetaObject::invokeMethod(this, [this, id, ok, error]() {
+            UiMonitor::nameCall("task completion");
+            completeTask(id, ok, error);
+        }, Qt::QueuedConnection);
+
+        QMutexLocker locker(&m_inPoolMutex);
+        if (--m_inPool == 0)
+            m_inPoolDone.wakeAll();
+    });
+}
+
+void InstallEngine::completeTask(const QString &id, bool ok, const QString &error) {
+    Task &task = m_tasks[id];
+    task.elapsedMs = task.timer.elapsed();
+    --m_running;
+
+    if (ok) {
+        task.state = TaskState::Done;
+        qDebug() << "Task" << id << "finished in" << task.elapsedMs << "ms";
+        emit taskFinished(id, task.elapsedMs);
+    } else {
+        task.state = TaskState::Failed;
+        m_failed = true;
+        qWarning() << "Task" << id << "failed after" << task.elapsedMs << "ms:" << error;
+        emit taskFailed(id, error);
+    }
+    scheduleReady();
+}
+
+void InstallEngine::markSkipped(const QString &id) {
+    Task &task = m_tasks[id];
+    if (task.state != TaskState::Pending)
+        return;
+    task.state = TaskState::Skipped;
+    emit taskSkipped(id);
+}
+
+void InstallEngine::checkFinished() {
+    if (m_finished || m_scheduling || m_running > 0)
+        return;
+
+    // A closed gate only holds the engine open while something still waits on it
+    bool waitingOnGate = false;
+    for (const QString &id : std::as_const(m_order)) {
+        const Task &task = m_tasks[id];
+        if (task.state != TaskState::Pending || task.gate)
+            continue;
+        for (const QString &dep : task.dependencies) {
+            const Task &depTask = m_tasks[dep];
+            if (depTask.state == TaskState::Pending && depTask.gate && !depTask.gateOpen)
+                waitingOnGate = true;
+        }
+    }
+    if (waitingOnGate)
+        return;
+
+    // Nothing is running and no gate can unblock the rest: whatever is still
+    // pending sits on a dependency cycle and can never run.
+    for (const QString &id : std::as_const(m_order)) {
+        Task &task = m_tasks[id];
+        if (task.state == TaskState::Pending && task.gate) {
+            markSkipped(id);
+        } else if (task.state == TaskState::Pending) {
+            qWarning() << "InstallEngine: task" << id << "is unreachable";
+            markSkipped(id);
+            m_failed = true;
+        }
+    }
+
+    m_finished = true;
+    emit finished(!m_failed && !isCancelled());
+}
@@ -0,0 +1,98 @@
+#ifndef INSTALLENGINE_H
+#define INSTALLENGINE_H
+
+#include <QObject>
+#include <QString>
+#include <QStringList>
+#include <QHash>
+#include <QElapsedTimer>
+#include <QMutex>
+#include <QWaitCondition>
+#include <functional>
+#include <atomic>
+
+class QThreadPool;
+
+// Runs the install as a dependency graph of tasks. Tasks whose dependencies
+// are satisfied run concurrently on a shared thread pool; all bookkeeping
+// happens on the thread that owns the engine, so observers can connect to the
+// signals below without any locking.
+class InstallEngine : public QObject {
+    Q_OBJECT
+public:
+    enum class TaskState { Pending, Running, Done, Failed, Skipped };
+    Q_ENUM(TaskState)
+
+    // Runs on a pool thread. Return false and fill in error to fail the task.
+    using TaskFunction = std::function<bool(QString &error)>;
+
+    explicit InstallEngine(QObject *parent = nullptr);
+    ~InstallEngine();
+
+    void addTask(const QString &id, const QStringList &dependencies, TaskFunction work);
+    // A gate is a task without work that completes once openGate() is called,
+    // used to hold parts of the graph until the user has confirmed something.
+    void addGate(const QString &id, const QStringList &dependencies = {});
+    void openGate(const QString &id);
+    // Marks a pending task (and everything that depends on it) as skipped.
+    void skipTask(const QString &id);
+
+    void setThreadPool(QThreadPool *pool);
+    // Caps how many tasks whose id starts with prefix may run at once, e.g.
+    // "download:" to bound concurrent transfers. Can be changed while running.
+    void setGroupLimit(const QString &prefix, int limit);
+    void start();
+    void cancel();
+
+    bool isRunning() const;
+    bool isCancelled() const;
+    bool hasTask(const QString &id) const;
+    TaskState taskState(const QString &id) const;
+    qint64 taskElapsedMs(const QString &id) const;
+
+signals:
+    void taskStarted(const QString &id);
+    void taskFinished(const QString &id, qint64 elapsedMs);
+    void taskFailed(const QString &id, const QString &error);
+    void taskSkipped(const QString &id);
+    void finished(bool success);
+
+private:
+    struct Task {
+        QStringList dependencies;
+        TaskFunction work;
+        bool gate = false;
+        bool gateOpen = false;
+        TaskState state = TaskState::Pending;
+        QElapsedTimer timer;
+        qint64 elapsedMs = 0;
+    };
+
+    void scheduleReady();
+    void runTask(const QString &id);
+    void completeTask(const QString &id, bool ok, const QString &error);
+    void markSkipped(const QString &id);
+    bool dependenciesDone(const Task &task) const;
+    bool dependencyAborted(const Task &task) const;
+    bool groupHasCapacity(const QString &id) const;
+    void checkFinished();
+
+    QHash<QString, Task> m_tasks;
+    QStringList m_order;
+    QHash<QString, int> m_groupLimits;
+    QThreadPool *m_pool;
+    int m_running = 0;
+    // Tasks of this engine still on a pool thread; the pool may be shared
+    // with other engines, so teardown waits on these rather than the pool.
+    int m_inPool = 0;
+    QMutex m_inPoolMutex;
+    QWaitCondition m_inPoolDone;
+    bool m_started = false;
+    bool m_scheduling = false;
+    bool m_rescheduleRequested = false;
+    bool m_finished = false;
+    bool m_failed = false;
+    std::atomic<bool> m_cancelled{false};
+};
+
+#endif // INSTALLENGINE_H
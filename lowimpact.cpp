@@ -0,0 +1,120 @@
+#include "lowimpact.h"
+#include <QFile>
+#include <QThread>
+#include <QElapsedTimer>
+#include <QMutex>
+#include <QDebug>
+#include <atomic>
+
+#ifdef Q_OS_WIN
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#elif defined(Q_OS_LINUX)
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// glibc has no wrapper for these; values from linux/ioprio.h
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_BE 2
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_WHO_PROCESS 1
+#endif
+
+static std::atomic<bool> s_enabled{false};
+static std::atomic<double> s_budget{10.0};
+
+void LowImpact::enable(double budgetPercent) {
+    s_budget.store(budgetPercent > 0 ? budgetPercent : 10.0);
+    s_enabled.store(true);
+    applyToCurrentThread();
+    qDebug() << "Low-impact mode: idle priority, pressure budget" << s_budget.load() << "%";
+}
+
+bool LowImpact::isEnabled() {
+    return s_enabled.load(std::memory_order_relaxed);
+}
+
+void LowImpact::applyToCurrentThread() {
+    if (isEnabled())
+        setThreadBackground(true);
+}
+
+void LowImpact::setThreadBackground(bool background) {
+#ifdef Q_OS_WIN
+    // Lowers CPU, I/O and memory priority of this thread in one go
+    SetThreadPriority(GetCurrentThread(), background ? THREAD_MODE_BACKGROUND_BEGIN : THREAD_MODE_BACKGROUND_END);
+#elif defined(Q_OS_LINUX)
+    // who = 0 is the calling thread; 4 is the default best-effort level
+    setpriority(PRIO_PROCESS, 0, background ? 19 : 0);
+    int ioprio = background ? IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT : (IOPRIO_CLASS_BE << IOPRIO_CLASS_SHIFT) | 4;
+    syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, ioprio);
+#else
+    Q_UNUSED(background);
+#endif
+}
+
+#ifdef Q_OS_LINUX
+// "some avg10=" of a /proc/pressure file, -1 if the kernel has no PSI
+static double pressureAvg10(const char *path) {
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly))
+        return -1;
+    QByteArray line = file.readLine();
+    int at = line.indexOf("avg10=");
+    if (!line.startsWith("some") || at < 0)
+        return -1;
+    return line.mid(at + 6, line.indexOf(' ', at) - at - 6).toDouble();
+}
+
+static double loadPerCore() {
+    QFile file("/proc/loadavg");
+    if (!file.open(QIODevice::ReadOnly))
+        return 0;
+    return file.readAll().split(' ').value(0).toDouble() / qMax(1, QThread::idealThreadCount());
+}
+#endif
+
+bool LowImpact::hostBusy() {
+    static QMutex mutex;
+    static QElapsedTimer sampled;
+    static bool busy = false;
+
+    QMutexLocker locker(&mutex);
+    if (sampled.isValid() && sampled.elapsed() < 500)
+        return busy;
+    sampled.start();
+
+#ifdef Q_OS_LINUX
+    // Hysteresis: once over budget, wait until we are well under it
+    double budget = s_budget.load();
+    double limit = busy ? budget / 2 : budget;
+    double cpu = pressureAvg10("/proc/pressure/cpu");
+    double io = pressureAvg10("/proc/pressure/io");
+    if (cpu >= 0 || io >= 0)
+        busy = cpu > limit || io > limit;
+    else
+        busy = loadPerCore() > (busy ? 0.7 : 0.9);
+#else
+    // No pressure metrics to go by; priorities alone have to do
+    busy = false;
+#endif
+    return busy;
+}
+
+void LowImpact::waitWhileBusy(const std::function<bool()> &canceled) {
+    if (!isEnabled() || !hostBusy())
+        return;
+
+    QElapsedTimer waited;
+    waited.start();
+    while (hostBusy()) {
+        if (canceled && canceled())
+            return;
+        // hostBusy() samples twice a second; the short nap is for cancel
+        QThread::msleep(100);
+    }
+    qDebug() << "Low-impact mode: backed off for" << waited.elapsed() << "ms";
+}
@@ -0,0 +1,32 @@
+#ifndef LOWIMPACT_H
+#define LOWIMPACT_H
+
+#include <functional>
+
+// Low-impact mode for installing onto hosts that are serving traffic: the
+// installer's threads drop to idle CPU and I/O priority, it runs a single
+// download and extraction at a time, and it pauses whenever the host's
+// pressure-stall (PSI) figures or load average go over the budget.
+class LowImpact {
+public:
+    // budgetPercent: share of time tasks may stall on CPU or I/O (PSI
+    // "some avg10") before the installer backs off
+    static void enable(double budgetPercent);
+    static bool isEnabled();
+
+    // Linux priorities are per thread, so every worker calls this itself
+    static void applyToCurrentThread();
+    // Idle CPU and I/O priority for the calling thread whatever the mode, or
+    // back to normal. An unprivileged Linux thread cannot lower its nice
+    // value again, so there only the I/O priority comes back.
+    static void setThreadBackground(bool background);
+
+    // Blocks while the host is over budget. Cheap when it is not: the
+    // pressure files are read at most twice a second.
+    static void waitWhileBusy(const std::function<bool()> &canceled = {});
+
+private:
+    static bool hostBusy();
+};
+
+#endif // LOWIMPACT_H
@@ -1,18 +1,134 @@
 #include "mainwindow.h"
+#include "utils.h"
+#include "stagedinstall.h"
+#include "tracer.h"
+#include "lowimpact.h"
+#include "downloadmanager.h"
+#include "uimonitor.h"
+#include "memorybudget.h"
 #include <QApplication>
 #include <QLocale>
 #include <QTranslator>
 #include <QStyleFactory>
+#include <QElapsedTimer>
+#include <QTimer>
+#include <QCommandLineParser>
+#include <QDebug>
+
+// libcurl's global setup is not thread-safe; once for the process, torn
+// down after everything else in main (the window waits for its downloads)
+struct CurlGlobal {
+    CurlGlobal() { curl_global_init(CURL_GLOBAL_ALL); }
+    ~CurlGlobal() { curl_global_cleanup(); }
+};
 
 int main(int argc, char *argv[])
 {
-    QApplication app(argc, argv);
+    CurlGlobal curl;
+    QElapsedTimer startupTimer;
+    startupTimer.start();
+
+    MonitoredApplication app(argc, argv);
+
+    QCommandLineParser parser;
+    parser.addHelpOption();
+    QCommandLineOption rollbackOption("rollback", "Restore the version replaced by the last upgrade in <dir>.", "dir");
+    parser.addOption(rollbackOption);
+    QCommandLineOption traceOption("trace", "Record a Chrome/Perfetto trace of the install to <file>.", "file");
+    parser.addOption(traceOption);
+    QCommandLineOption lowImpactOption("low-impact", "Install at idle CPU/I/O priority, one task at a time, backing off under load.");
+    parser.addOption(lowImpactOption);
+    QCommandLineOption budgetOption("pressure-budget", "Low-impact mode: CPU/I/O pressure (PSI avg10, %) to stay under.", "percent", "10");
+    parser.addOption(budgetOption);
+    QCommandLineOption directIoOption("direct-io", "Write payloads with O_DIRECT, bypassing the page cache.");
+    parser.addOption(directIoOption);
+    QCommandLineOption deletePayloadOption("delete-payload", "Delete downloaded payloads once the install is committed.");
+    parser.addOption(deletePayloadOption);
+    QCommandLineOption profileOption("profile", "Preselect the manifest profile <name>, e.g. minimal-server.", "name");
+    parser.addOption(profileOption);
+    QCommandLineOption includeOption("include", "Only extract archive paths matching <glob>; may be repeated.", "glob");
+    parser.addOption(includeOption);
+    QCommandLineOption excludeOption("exclude", "Do not extract archive paths matching <glob>; may be repeated.", "glob");
+    parser.addOption(excludeOption);
+    QCommandLineOption uiMonitorOption("ui-monitor", "Measure GUI-thread latency and log a report at exit.");
+    parser.addOption(uiMonitorOption);
+    QCommandLineOption benchmarkOption("benchmark-ui", "Run a full install into <dir> unattended and print UI latency percentiles.", "dir");
+    parser.addOption(benchmarkOption);
+    QCommandLineOption benchmarkCancelOption("benchmark-cancel", "With --benchmark-ui: cancel the install after <ms> and report how long stopping took.", "ms");
+    parser.addOption(benchmarkCancelOption);
+    QCommandLineOption dedupOption("dedup", "How files with the same content are installed: reflink, hardlink, copy or off. "
+                                    "With hardlink the copies share one inode, so writing to one in place changes all of them.", "mode", "reflink");
+    parser.addOption(dedupOption);
+    QCommandLineOption sourceOption("source", "Install from a mirror URL, a local directory or file:// URL holding the manifest and payloads.", "dir|url");
+    parser.addOption(sourceOption);
+    QCommandLineOption copySourceOption("copy-source", "Copy local payloads into the cache first instead of extracting them in place.");
+    parser.addOption(copySourceOption);
+    QCommandLineOption noWarmStartOption("no-warm-start", "Do not prefetch the launched program and its libraries into the page cache.");
+    parser.addOption(noWarmStartOption);
+    QCommandLineOption memoryBudgetOption("memory-budget", "Keep the install within <MiB> of memory, 0 for no limit. Defaults to half the container's memory limit.", "MiB");
+    parser.addOption(memoryBudgetOption);
+    parser.process(app);
+
+    // Before any worker thread exists, so they all inherit it
+    if (parser.isSet(lowImpactOption) || qEnvironmentVariableIntValue("SCRUTANET_LOW_IMPACT"))
+        LowImpact::enable(parser.value(budgetOption).toDouble());
+
+    QString tracePath = parser.isSet(traceOption) ? parser.value(traceOption) : qEnvironmentVariable("SCRUTANET_TRACE");
+    if (!tracePath.isEmpty())
+        Tracer::instance().enable(tracePath);
+
+    DownloadManager::setDirectIo(parser.isSet(directIoOption));
+
+    if (parser.isSet(memoryBudgetOption))
+        MemoryBudget::instance().setLimit(parser.value(memoryBudgetOption).toLongLong() * 1024 * 1024);
+    else
+        MemoryBudget::instance().setLimit(MemoryBudget::containerLimit() / 2);
+
+    if (parser.isSet(rollbackOption)) {
+        QString error;
+        if (!StagedInstall(parser.value(rollbackOption)).rollback(error)) {
+            qWarning() << "Rollback failed:" << error;
+            return 1;
+        }
+        qDebug() << "Rolled back" << parser.value(rollbackOption);
+        return 0;
+    }
+
     app.setWindowIcon(QIcon(":/icons/appicon.png"));
     QApplication::setStyle(QStyleFactory::create("Fusion"));
+    qint64 windowStart = Tracer::instance().now();
     MainWindow w;
     w.setWindowTitle("ScrutaNet Installer");
+    w.setDeletePayloads(parser.isSet(deletePayloadOption));
+    const QHash<QString, DedupMode> dedupModes = {
+        {"reflink", DedupMode::Reflink}, {"hardlink", DedupMode::Hardlink},
+        {"copy", DedupMode::Copy}, {"off", DedupMode::Off}};
+    if (!dedupModes.contains(parser.value(dedupOption)))
+        qWarning() << "Unknown --dedup mode" << parser.value(dedupOption) << "- using reflink";
+    w.setDedupMode(dedupModes.value(parser.value(dedupOption), DedupMode::Reflink));
+    w.setSource(parser.value(sourceOption), parser.isSet(copySourceOption));
+    w.setWarmStart(!parser.isSet(noWarmStartOption));
+    w.setSelection(parser.value(profileOption), parser.values(includeOption), parser.values(excludeOption));
     w.show();
+    if (parser.isSet(uiMonitorOption) || qEnvironmentVariableIntValue("SCRUTANET_UI_MONITOR"))
+        UiMonitor::instance().start();
+    if (parser.isSet(benchmarkOption)) {
+        w.setBenchmarkCancel(parser.value(benchmarkCancelOption).toLongLong());
+        w.runBenchmark(parser.value(benchmarkOption));
+    }
+    Tracer::instance().complete("startup", "create window", windowStart, Tracer::instance().now() - windowStart);
+
+    // Report cold-start cost once the first frame has been scheduled
+    QTimer::singleShot(0, &w, [&startupTimer]() {
+        qDebug() << "Startup:" << startupTimer.elapsed() << "ms, RSS"
+                 << currentRssBytes() / 1024 << "KB";
+        if (Tracer::isEnabled())
+            Tracer::instance().instant("startup", "first frame");
+    });
 
     int result = app.exec();
+    Tracer::instance().flush();
+    if (UiMonitor::isEnabled() && !parser.isSet(benchmarkOption))
+        qDebug().noquote() << UiMonitor::instance().report();
     return result;
 }
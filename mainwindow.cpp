@@ -1,5 +1,11 @@
 #include "mainwindow.h"
 #include "./ui_mainwindow.h"
+#include "tracer.h"
+#include "lowimpact.h"
+#include "pagecache.h"
+#include "uimonitor.h"
+#include "memorybudget.h"
+#include "utils.h"
 #include <QFile>
 #include <QDir>
 #include <QDebug>
@@ -8,28 +14,33 @@
 #include <QtConcurrent/QtConcurrent>
 #include <QStandardPaths>
 #include <QEventLoop>
+#include <QTimer>
 #include <QUrl>
 #include <QFileDialog>
 #include <QFileInfo>
+#include <QResource>
+#include <QProcess>
+#include <QFutureWatcher>
+#include <QListWidget>
+#include <QSignalBlocker>
+#include <QMutex>
+#include <QThreadPool>
+#include <QTextStream>
+#include <QSet>
+#include <QtEndian>
+#include <QStorageInfo>
+#include <QElapsedTimer>
 #include <atomic>
+#include <cstring>
+#include <streambuf>
 #include <bit7z/bit7zlibrary.hpp>
 #include <bit7z/bitfileextractor.hpp>
 #include <bit7z/bitexception.hpp>
 #include <bit7z/bitinputarchive.hpp>
 #include <iostream>
 
-std::atomic<bool> m_cancelExtraction {false};
-QFuture<void> m_extractionFuture;
 qint64 totalFileSize;
 
-std::atomic<bool> m_pauseExtraction{false};
-std::mutex m_pauseMutex;
-std::condition_variable m_pauseCv;
-
-DownloadManager *manager;
-DownloadControlFlags *m_controlFlags;
-QThread *workerThread;
-
 QLabel *nextButtonLabel;
 QLabel *backButtonLabel;
 QLabel *browseButtonLabel;
@@ -39,16 +50,42 @@ QLabel *cancelDownloadButtonLabel;
 QLabel *resumeInstallationButtonLabel;
 QLabel *cancelInstallationButtonLabel;
 
-QString url = "http://192.168.1.29/Data.bin";
-QString file;
-QString fileNameStr = "/Data.bin";
-QString filePath = "Data.bin";
+#ifdef Q_OS_WIN
+QString url = "http://192.168.1.29/Data_WINDOWS.bin";
+QString manifestUrl = "http://192.168.1.29/manifest_WINDOWS.json";
+#else
+QString url = "http://192.168.1.29/Data_LINUX.bin";
+QString manifestUrl = "http://192.168.1.29/manifest_LINUX.json";
+#endif
 QString dllPath;
+const QString archivePassword = "ah*&62I(FFqwrhg12r089YFDW(213r";
+// Speculative downloads stay well below what most links can do
+const qint64 prefetchRateLimit = 2 * 1024 * 1024;
+// Downloads at once; they wait on the network, not on the target disk
+const int parallelDownloads = 4;
+// Volumes of one component that may be downloaded ahead of extraction
+const int volumeWindow = 4;
+// Smaller duplicates are simply extracted again
+const quint64 dedupMinSize = 4096;
+// How long --delete-payload waits for another installer to release a payload
+const qint64 deletePayloadWaitMs = 5000;
+// Most the warm start pulls into the page cache for the launch
+const qint64 warmStartBudget = 256 * 1024 * 1024;
+// Reserved per extraction on top of the dictionary: 7z's stream buffers,
+// and all of it when the archive does not say
+const qint64 extractOverhead = 16 * 1024 * 1024;
+const qint64 unknownDictionary = 64 * 1024 * 1024;
+// The 7z signature header, which says where the archive's index is
+const qint64 sevenZipSignatureSize = 32;
 
 std::atomic<bool> quitApp{false};
 bool darkMode = false;
 bool showMoreDetails = false;
 
+int downloadLimit() {
+    return LowImpact::isEnabled() ? 1 : parallelDownloads;
+}
+
 QString getDefaultInstallPath() {
 #ifdef Q_OS_WIN
     QString programFiles = qEnvironmentVariable("ProgramFiles");
@@ -83,24 +120,27 @@ void MainWindow::toggleInstallationDetails() {
 }
 
 void MainWindow::closeEvent(QCloseEvent* event) {
-    if (m_extractionFuture.isRunning()) {
-        qDebug() << "App closing: cancelling extraction...";
-        m_cancelExtraction.store(true);
+    stopPrefetches();
+    if (m_engine && m_engine->isRunning()) {
+        qDebug() << "App closing: cancelling installation...";
+        cancelInstall();
 
-        QEventLoop loop;
-        QTimer timer;
-        timer.setSingleShot(true);
+        if (m_engine->isRunning()) {
+            QEventLoop loop;
+            QTimer timer;
+            timer.setSingleShot(true);
 
-        QObject::connect(&m_extractionWatcher, &QFutureWatcher<void>::finished, &loop, &QEventLoop::quit);
-        QObject::connect(&timer, &QTimer::timeout, &loop, &QEventLoop::quit);
+            QObject::connect(m_engine, &InstallEngine::finished, &loop, &QEventLoop::quit);
+            QObject::connect(&timer, &QTimer::timeout, &loop, &QEventLoop::quit);
 
-        timer.start(5000);  // 5 seconds timeout
-        loop.exec();
+            timer.start(5000);  // 5 seconds timeout
+            loop.exec();
+        }
 
-        if (m_extractionFuture.isRunning()) {
-            qWarning() << "Extraction did not stop within timeout.";
+        if (m_engine->isRunning()) {
+            qWarning() << "Installation did not stop within timeout.";
         } else {
-            qDebug() << "Extraction stopped cleanly.";
+            qDebug() << "Installation stopped cleanly.";
         }
     }
 
@@ -111,7 +151,31 @@ QString MainWindow::getExeFolder() {
     return QApplication::applicationDirPath();
 }
 
+// The bundled payload lives in an external payload.rcc next to the executable
+// instead of being compiled in. Registering maps the file on demand, so the
+// bytes are only paged in when the payload is actually needed.
+bool MainWindow::registerPayloadResource() {
+    // Verify tasks for several components may get here at the same time
+    static QMutex mutex;
+    QMutexLocker locker(&mutex);
+    static bool registered = false;
+    if (registered)
+        return true;
+
+    QString rccPath = getExeFolder() + "/payload.rcc";
+    if (!QFile::exists(rccPath)) {
+        qWarning() << "Payload resource not found:" << rccPath;
+        return false;
+    }
+    registered = QResource::registerResource(rccPath);
+    if (!registered) {
+        qWarning() << "Failed to register payload resource:" << rccPath;
+    }
+    return registered;
+}
+
 QString MainWindow::extractEmbeddedDll() {
+    TraceScope trace("codec", "extract codec");
 #ifdef Q_OS_WIN
     QString dllPath = getExeFolder() + "/7z.dll";
     QFile dll(":/dependencies/7z.dll");
@@ -140,13 +204,18 @@ QString MainWindow::extractEmbeddedDll() {
         return QString();
     }
 
-    QByteArray data = dll.readAll();
-    dll.close();  // Close resource here immediately after reading
-
-    qint64 written = outFile.write(data);
-    if (written != data.size()) {
-        qWarning() << "DLL write incomplete";
+    // In pieces; a copy of the whole codec is memory a small VM may not have.
+    // This only streams because the codec resource is stored uncompressed.
+    QByteArray chunk(256 * 1024, Qt::Uninitialized);
+    while (!dll.atEnd()) {
+        qint64 n = dll.read(chunk.data(), chunk.size());
+        if (n <= 0 || outFile.write(chunk.constData(), n) != n) {
+            qWarning() << "DLL write incomplete";
+            outFile.remove();
+            return QString();
+        }
     }
+    dll.close();
 
     outFile.flush();
     outFile.close();
@@ -156,170 +225,1480 @@ QString MainWindow::extractEmbeddedDll() {
     return dllPath;
 }
 
-void MainWindow::extractResourceArchive(const QString& resourcePath, const QString& outputDir, const QString& password) {
-    QString archivePath = getExeFolder() + "/Data.bin";
+QString MainWindow::payloadPath(const Component& component) {
+    if (extractsInPlace(component))
+        return DownloadManager::localPath(component.url);
+    return m_cache.pathFor(PayloadCache::keyFor(component));
+}
 
-    dllPath = extractEmbeddedDll();
-    if (dllPath.isEmpty()) {
-        qCritical() << "Failed to extract 7z.dll";
-        return;
-    }
+bool MainWindow::extractsInPlace(const Component& component) const {
+    return !m_copySource && !DownloadManager::localPath(component.url).isEmpty();
+}
 
-    m_cancelExtraction.store(false);
+void MainWindow::setSource(const QString &source, bool copy) {
+    m_copySource = copy;
+    m_source = source;
+    while (m_source.endsWith('/'))
+        m_source.chop(1);
+    if (!m_source.isEmpty() && !m_source.contains("://"))
+        m_source = QUrl::fromLocalFile(QFileInfo(m_source).absoluteFilePath()).toString();
+}
+
+bool MainWindow::prepareArchive(const Component& component, QString &error) {
+    TraceScope trace("verify", "verify", component.name);
+    QString archivePath = payloadPath(component);
+    std::shared_ptr<CancelToken> token = m_token;
+    auto canceled = [token]() { return token->isCanceled(); };
+
+    // Another installer may be filling or evicting the same entry
+    auto lock = m_cache.lock(PayloadCache::keyFor(component), canceled);
+    if (!lock) {
+        error = "Canceled while waiting for the payload cache";
+        return false;
+    }
 
-    m_extractionFuture = QtConcurrent::run([=]() {
-        if (ui->tabWidget->currentIndex() == 3)
-        {
-            ui->nextButton->setDisabled(true);
-            ui->backButton->setDisabled(true);
+    // Fall back to the bundled payload when nothing was downloaded
+    bool inPlace = extractsInPlace(component);
+    if (!inPlace && !QFile::exists(archivePath) && !component.resource.isEmpty()
+        && registerPayloadResource() && QFile::exists(component.resource)) {
+        if (!QFile::copy(component.resource, archivePath)) {
+            qWarning() << "Failed to copy bundled payload to" << archivePath;
+        } else {
+            // Files copied out of resources are read-only
+            QFile::setPermissions(archivePath, QFileDevice::ReadOwner | QFileDevice::WriteOwner);
         }
+    }
 
-        /*QFile resourceFile(resourcePath);
-        if (!resourceFile.open(QIODevice::ReadOnly)) {
-            qWarning() << "Failed to open resource:" << resourcePath;
-            return;
+    if (!verifyComponentFile(component, archivePath, error, canceled)) {
+        // Only half read, nothing wrong with it
+        if (token->isCanceled()) {
+            token->acknowledge("verify " + component.name);
+            return false;
         }
+        // Never reuse a bad payload on the next run; the source's own copy is not ours to delete
+        if (!inPlace) {
+            QFile::remove(archivePath);
+            QFile::remove(archivePath + ".meta");
+        }
+        return false;
+    }
+    return true;
+}
 
-        QByteArray archiveData = resourceFile.readAll();
-        resourceFile.close();
+// A coder size as 7-Zip prints it: a power of two as its exponent ("24"),
+// anything else with a unit ("1536k", "3m")
+static quint64 coderSize(QString value) {
+    static const QHash<QChar, quint64> units = {{'b', 1}, {'k', 1024}, {'m', 1024 * 1024}, {'g', 1024 * 1024 * 1024}};
+    quint64 unit = value.isEmpty() ? 0 : units.value(value.back().toLower(), 0);
+    if (unit > 0)
+        value.chop(1);
+    bool ok = false;
+    quint64 n = value.toULongLong(&ok);
+    if (!ok)
+        return 0;
+    if (unit > 0)
+        return n * unit;
+    return n < 64 ? quint64(1) << n : n;
+}
 
-        QString tempPath = QDir::temp().filePath("temp_archive.7z");
-        QFile tempFile(tempPath);
-        if (!tempFile.open(QIODevice::WriteOnly)) {
-            qWarning() << "Failed to create temp file:" << tempPath;
-            return;
+// Memory the decoder for a method such as "LZMA2:24 BCJ" or "PPMD:o6:mem24"
+// allocates: about its dictionary, or PPMd's model size
+static quint64 decoderMemory(const QString &method) {
+    quint64 most = 0;
+    for (const QString &coder : method.split(' ', Qt::SkipEmptyParts)) {
+        const QStringList parts = coder.split(':');
+        for (int i = 1; i < parts.size(); ++i) {
+            if (parts[0].startsWith("LZMA") && i == 1)
+                most = qMax(most, coderSize(parts[i]));
+            else if (parts[0] == "PPMD" && parts[i].startsWith("mem"))
+                most = qMax(most, coderSize(parts[i].mid(3)));
         }
-        tempFile.write(archiveData);
-        tempFile.close();*/
+    }
+    return most;
+}
+
+bool MainWindow::scanArchive(const QString& archivePath, const QString& password, const EntryFilter& filter,
+                             ArchiveIndex &index, QString &error, std::istream *stream) {
+    TraceScope trace("extract", "scan", QFileInfo(archivePath).fileName());
+    uint64_t skippedSize = 0;
+    try {
+        bit7z::Bit7zLibrary lib(dllPath.toStdString());
+        bit7z::BitFileExtractor extractor(lib, bit7z::BitFormat::SevenZip);
 
-        try {
-            bit7z::Bit7zLibrary lib(dllPath.toStdString());
-            bit7z::BitFileExtractor extractor(lib, bit7z::BitFormat::SevenZip);
+        if (!password.isEmpty()) {
+            extractor.setPassword(password.toStdString());
+        }
 
-            if (!password.isEmpty()) {
-                extractor.setPassword(password.toStdString());
+        // One pass over the index for the totals and the per-file list
+        std::unique_ptr<bit7z::BitInputArchive> opened =
+            stream ? std::make_unique<bit7z::BitInputArchive>(extractor, *stream)
+                   : std::make_unique<bit7z::BitInputArchive>(extractor, archivePath.toStdString());
+        const bit7z::BitInputArchive &archive = *opened;
+        QString lastMethod;
+        for (const auto& item : archive) {
+            ArchiveEntry entry;
+            entry.index = item.index();
+            entry.path = QDir::fromNativeSeparators(QString::fromStdString(item.path()));
+            entry.size = item.size();
+            entry.crc = item.crc();
+            entry.isDir = item.isDir();
+            index.items++;
+            // Left out entries are neither extracted nor counted
+            if (!filter.matches(entry.path)) {
+                skippedSize += entry.size;
+                continue;
             }
+            index.entries.append(entry);
+            index.pending.push_back(entry.index);
+
+            index.size += entry.size;
+            if (!entry.isDir) {
+                index.files++;
+                // Usually the same for every item; parse each one once
+                bit7z::BitPropVariant method = item.itemProperty(bit7z::BitProperty::Method);
+                if (method.isString() && QString::fromStdString(method.getString()) != lastMethod) {
+                    lastMethod = QString::fromStdString(method.getString());
+                    index.decoderMemory = qMax<uint64_t>(index.decoderMemory, decoderMemory(lastMethod));
+                }
+            }
+        }
+    } catch (const bit7z::BitException& e) {
+        error = QString::fromUtf8(e.what());
+        return false;
+    }
+
+    qDebug() << archivePath << "holds" << index.files << "selected files," << humanSize(index.size)
+             << "- decoder needs" << (index.decoderMemory > 0 ? humanSize(index.decoderMemory) : QString("unknown"));
+    if (size_t(index.entries.size()) < index.items)
+        qDebug() << "Selection leaves out" << index.items - index.entries.size() << "items," << humanSize(skippedSize);
+    return true;
+}
 
-            //bit7z::BitInputArchive archive(extractor, tempPath.toStdString());
-            bit7z::BitInputArchive archive(extractor, archivePath.toStdString());
-            uint64_t totalSize = 0;
-            for (const auto& item : archive) {
-                totalSize += item.size();
+// What preflight fetched of a payload, at its offsets in a stream the size of
+// the payload. The part in between was not fetched and reads as zeros;
+// listing the archive never gets there.
+class PayloadEnds : public std::streambuf {
+public:
+    PayloadEnds(const QByteArray &head, qint64 tailOffset, const QByteArray &tail)
+        : m_head(head), m_tail(tail), m_tailOffset(tailOffset), m_size(tailOffset + tail.size()) {}
+
+protected:
+    std::streamsize xsgetn(char *out, std::streamsize count) override {
+        qint64 pos = position();
+        setg(nullptr, nullptr, nullptr);
+        qint64 n = qBound<qint64>(0, count, m_size - pos);
+        for (qint64 done = 0; done < n;) {
+            qint64 at = pos + done;
+            qint64 chunk;
+            if (at < m_head.size()) {
+                chunk = qMin(n - done, m_head.size() - at);
+                std::memcpy(out + done, m_head.constData() + at, size_t(chunk));
+            } else if (at >= m_tailOffset) {
+                chunk = n - done;
+                std::memcpy(out + done, m_tail.constData() + (at - m_tailOffset), size_t(chunk));
+            } else {
+                chunk = qMin(n - done, m_tailOffset - at);
+                std::memset(out + done, 0, size_t(chunk));
             }
+            done += chunk;
+        }
+        m_pos = pos + n;
+        return n;
+    }
+
+    int_type underflow() override {
+        qint64 pos = position();
+        if (pos >= m_size)
+            return traits_type::eof();
+        xsgetn(&m_char, 1);
+        setg(&m_char, &m_char, &m_char + 1);
+        return traits_type::to_int_type(m_char);
+    }
+
+    pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode) override {
+        qint64 base = dir == std::ios_base::beg ? 0 : dir == std::ios_base::end ? m_size : position();
+        qint64 pos = base + off;
+        if (pos < 0 || pos > m_size)
+            return pos_type(off_type(-1));
+        setg(nullptr, nullptr, nullptr);
+        m_pos = pos;
+        return pos_type(pos);
+    }
+
+    pos_type seekpos(pos_type pos, std::ios_base::openmode which) override {
+        return seekoff(off_type(pos), std::ios_base::beg, which);
+    }
+
+private:
+    // Where the reader is: m_pos less what underflow() handed out but was
+    // not read yet
+    qint64 position() const { return m_pos - (egptr() - gptr()); }
+
+    QByteArray m_head;
+    QByteArray m_tail;
+    qint64 m_tailOffset;
+    qint64 m_size;
+    qint64 m_pos = 0;
+    char m_char = 0;
+};
+
+// Lists a payload before it has been downloaded. A 7z archive keeps its
+// index at the end, so only the signature header and the tail are fetched
+// with range requests; the archive is listed from memory.
+bool MainWindow::preflightArchive(const Component& component, const QString& password, const EntryFilter& filter,
+                                  ArchiveIndex &index, QString &error, const CancelToken *token) {
+    TraceScope trace("preflight", "preflight", component.name);
+    QString archivePath = payloadPath(component);
+    // Already complete on disk: nothing to fetch
+    if (extractsInPlace(component) || m_cache.isComplete(PayloadCache::keyFor(component), component.size))
+        return scanArchive(archivePath, password, filter, index, error);
+
+    qint64 total = component.size > 0 ? component.size : DownloadManager::remoteFileSize(component.url, token);
+    if (total <= sevenZipSignatureSize) {
+        error = "Size of " + component.name + " unknown";
+        return false;
+    }
+    QByteArray head;
+    if (!DownloadManager::fetchRange(component.url, 0, sevenZipSignatureSize, head, error, token))
+        return false;
+    if (head.size() != sevenZipSignatureSize || !head.startsWith(QByteArray("7z\xBC\xAF\x27\x1C", 6))) {
+        error = component.name + " is not a 7z archive";
+        return false;
+    }
+    qint64 headerStart = sevenZipSignatureSize + qFromLittleEndian<qint64>(head.constData() + 12);
+    if (headerStart <= sevenZipSignatureSize || headerStart >= total) {
+        error = component.name + ": archive header out of range";
+        return false;
+    }
+
+    // A compressed index has its packed data right before it; if the first
+    // tail was too short, try again with more
+    bool listed = false;
+    for (qint64 slack : {qint64(1) << 20, qint64(16) << 20}) {
+        qint64 from = qMax(sevenZipSignatureSize, headerStart - slack);
+        // The tail, and about as much again for what bit7z parses from it
+        qint64 reserve = 2 * (total - from);
+        if (token && !MemoryBudget::instance().acquire(reserve, *token)) {
+            error = "Canceled";
+            break;
+        }
+        QByteArray tail;
+        bool fetched = DownloadManager::fetchRange(component.url, from, total - from, tail, error, token);
+        if (fetched && tail.size() != total - from) {
+            error = QString("%1: got %2 of %3 bytes of the archive tail").arg(component.name).arg(tail.size()).arg(total - from);
+            fetched = false;
+        }
+        if (fetched) {
+            PayloadEnds ends(head, from, tail);
+            std::istream stream(&ends);
+            index = ArchiveIndex();
+            listed = scanArchive(archivePath, password, filter, index, error, &stream);
+        }
+        tail.clear();
+        if (token)
+            MemoryBudget::instance().release(reserve);
+        if (!fetched || listed || from == sevenZipSignatureSize)
+            break;
+    }
+    return listed;
+}
+
+bool MainWindow::carryOverUnchanged(const QString& name, const StagedInstall& staged, const InstalledState& installed,
+                                    ArchiveIndex &index, QString &error) {
+    TraceScope trace("extract", "carry over", name);
+    std::vector<uint32_t> pending;
+    size_t carried = 0;
+    uint64_t carriedSize = 0;
+
+    for (const ArchiveEntry &entry : std::as_const(index.entries)) {
+        if (m_token->isCanceled()) {
+            error = "Carrying over " + name + " canceled";
+            return false;
+        }
+        const InstalledState::File *file = installed.file(entry.path);
+        bool unchanged = !entry.isDir && file && file->size == entry.size && file->crc == entry.crc
+                         && QFileInfo(staged.installDir() + "/" + entry.path).size() == qint64(entry.size);
+        if (!unchanged) {
+            pending.push_back(entry.index);
+            continue;
+        }
+        if (!staged.carryOver(entry.path, error))
+            return false;
+        carried++;
+        carriedSize += entry.size;
+    }
+
+    index.pending = std::move(pending);
+    index.files -= carried;
+    index.size -= carriedSize;
+    if (carried > 0)
+        qDebug() << name << ": kept" << carried << "unchanged files," << humanSize(carriedSize);
+    return true;
+}
+
+// Archive entries with the same size and CRC are probably the same content:
+// only the first is extracted, the rest are compared with it and linked or
+// cloned from it afterwards. The 7z index has no stronger hash; small files
+// are not worth it.
+void MainWindow::planDuplicates(const QString& name, DedupMode mode, ArchiveIndex &index) {
+    if (mode == DedupMode::Off || index.pending.empty())
+        return;
+
+    QSet<uint32_t> pending(index.pending.begin(), index.pending.end());
+    QHash<QPair<quint64, quint32>, QString> extracted;
+    std::vector<uint32_t> unique;
+    uint64_t savedSize = 0;
+
+    for (const ArchiveEntry &entry : std::as_const(index.entries)) {
+        if (!pending.contains(entry.index))
+            continue;
+        if (entry.isDir || entry.size < dedupMinSize) {
+            unique.push_back(entry.index);
+            continue;
+        }
+        QPair<quint64, quint32> content(entry.size, entry.crc);
+        auto first = extracted.constFind(content);
+        if (first == extracted.constEnd()) {
+            extracted.insert(content, entry.path);
+            unique.push_back(entry.index);
+            continue;
+        }
+        index.duplicates.append({entry, first.value()});
+        index.size -= entry.size;
+        index.files--;
+        savedSize += entry.size;
+    }
 
-            QElapsedTimer timer;
-            timer.start();
+    index.pending = std::move(unique);
+    if (!index.duplicates.isEmpty())
+        qDebug() << name << ":" << index.duplicates.size() << "duplicate files," << humanSize(savedSize) << "not extracted";
+}
 
-            size_t totalFiles = 0;
-            for (const auto& item : archive) {
-                if (!item.isDir()) {
-                    totalFiles++;
+// Takes what bit7z decodes and compares it with a file on disk, so a
+// duplicate can be checked without writing it
+class MatchesFile : public std::streambuf {
+public:
+    explicit MatchesFile(const QString &path) : m_file(path) { m_matches = m_file.open(QIODevice::ReadOnly); }
+    // Also false when the file is longer than what was decoded
+    bool matches() { return m_matches && m_file.atEnd(); }
+
+protected:
+    std::streamsize xsputn(const char *data, std::streamsize count) override {
+        if (m_matches && m_file.read(qint64(count)) != QByteArray::fromRawData(data, qsizetype(count)))
+            m_matches = false;
+        return count;
+    }
+
+    int_type overflow(int_type ch) override {
+        if (traits_type::eq_int_type(ch, traits_type::eof()))
+            return traits_type::not_eof(ch);
+        char c = traits_type::to_char_type(ch);
+        xsputn(&c, 1);
+        return ch;
+    }
+
+private:
+    QFile m_file;
+    bool m_matches = false;
+};
+
+// Writes what bit7z decodes to a file
+class ToFile : public std::streambuf {
+public:
+    explicit ToFile(const QString &path) : m_file(path) { m_ok = m_file.open(QIODevice::WriteOnly | QIODevice::Truncate); }
+    bool ok() { return m_ok && m_file.flush(); }
+
+protected:
+    std::streamsize xsputn(const char *data, std::streamsize count) override {
+        if (m_ok && m_file.write(data, qint64(count)) != qint64(count))
+            m_ok = false;
+        return count;
+    }
+
+    int_type overflow(int_type ch) override {
+        if (traits_type::eq_int_type(ch, traits_type::eof()))
+            return traits_type::not_eof(ch);
+        char c = traits_type::to_char_type(ch);
+        xsputn(&c, 1);
+        return ch;
+    }
+
+private:
+    QFile m_file;
+    bool m_ok = false;
+};
+
+// Size and CRC32 can collide, so each duplicate is decoded once more and
+// compared byte for byte with the copy that was extracted; only then is it
+// linked. One that differs is written out like any other entry.
+bool MainWindow::materializeDuplicates(const QString& archivePath, const QString& password, const QString& outputDir,
+                                       const ArchiveIndex &index, DedupMode mode, QString &error) {
+    TraceScope trace("extract", "duplicates");
+    if (index.duplicates.isEmpty())
+        return true;
+    try {
+        bit7z::Bit7zLibrary lib(dllPath.toStdString());
+        bit7z::BitFileExtractor extractor(lib, bit7z::BitFormat::SevenZip);
+        if (!password.isEmpty())
+            extractor.setPassword(password.toStdString());
+        bit7z::BitInputArchive archive(extractor, archivePath.toStdString());
+
+        for (const auto &duplicate : index.duplicates) {
+            if (m_token->isCanceled()) {
+                error = "Canceled while linking duplicates";
+                return false;
+            }
+            const ArchiveEntry &entry = duplicate.first;
+            QString from = outputDir + "/" + duplicate.second;
+            QString to = outputDir + "/" + entry.path;
+            if (!QDir().mkpath(QFileInfo(to).path())) {
+                error = "Cannot create directory for " + to;
+                return false;
+            }
+
+            MatchesFile compare(from);
+            std::ostream compareStream(&compare);
+            archive.extractTo(compareStream, entry.index);
+            if (!compare.matches()) {
+                qWarning() << entry.path << "has the size and CRC of" << duplicate.second << "but not its content";
+                ToFile write(to);
+                std::ostream writeStream(&write);
+                archive.extractTo(writeStream, entry.index);
+                if (!write.ok()) {
+                    error = "Cannot write " + to;
+                    return false;
                 }
+                continue;
             }
 
-            auto extractedFiles = std::make_shared<std::atomic<size_t>>(0);
+            bool done = false;
+            if (mode == DedupMode::Hardlink)
+                done = StagedInstall::hardLink(from, to);
+            if (!done && mode == DedupMode::Copy) {
+                QFile::remove(to);
+                done = QFile::copy(from, to);
+            }
+            // Also the fallback where hard links are not possible
+            if (!done && mode != DedupMode::Copy)
+                done = StagedInstall::cloneFile(from, to);
+            if (!done) {
+                error = "Cannot create " + to + " from " + from;
+                return false;
+            }
+        }
+    } catch (const bit7z::BitException& e) {
+        error = QString::fromUtf8(e.what());
+        return false;
+    }
+    return true;
+}
 
-            // Show current file being extracted
-            extractor.setFileCallback([this, extractedFiles, totalFiles](bit7z::tstring filePath) {
-                extractedFiles->fetch_add(1);
+bool MainWindow::extractResourceArchive(const QString& name, const QString& archivePath, const QString& outputDir,
+                                        const QString& password, const ArchiveIndex &index, QString &error) {
+    TraceScope trace("extract", "extract", name);
+    /*QFile resourceFile(resourcePath);
+    if (!resourceFile.open(QIODevice::ReadOnly)) {
+        qWarning() << "Failed to open resource:" << resourcePath;
+        return;
+    }
 
-                QString fileName = QString::fromStdString(filePath);
-                QMetaObject::invokeMethod(this, [this, fileName, extractedFiles, totalFiles]() {
+    QByteArray archiveData = resourceFile.readAll();
+    resourceFile.close();
 
-                    onLogMessage(
-                        QString("%1 (%2 of %3)")
-                            .arg(fileName)
-                            .arg(extractedFiles->load())
-                            .arg(totalFiles)
-                        );
-                }, Qt::QueuedConnection);
+    QString tempPath = QDir::temp().filePath("temp_archive.7z");
+    QFile tempFile(tempPath);
+    if (!tempFile.open(QIODevice::WriteOnly)) {
+        qWarning() << "Failed to create temp file:" << tempPath;
+        return;
+    }
+    tempFile.write(archiveData);
+    tempFile.close();*/
+
+    try {
+        bit7z::Bit7zLibrary lib(dllPath.toStdString());
+        bit7z::BitFileExtractor extractor(lib, bit7z::BitFormat::SevenZip);
+
+        if (!password.isEmpty()) {
+            extractor.setPassword(password.toStdString());
+        }
+
+        uint64_t totalSize = index.size;
+        size_t totalFiles = index.files;
+
+        auto extractedFiles = std::make_shared<std::atomic<size_t>>(0);
+
+        // bit7z reads the payload front to back; stay a window ahead of it
+        // and drop what it has passed
+        auto readAhead = std::make_shared<ReadAhead>(archivePath);
+
+        // Show current file being extracted
+        extractor.setFileCallback([this, name, extractedFiles, totalFiles](bit7z::tstring filePath) {
+            extractedFiles->fetch_add(1);
+
+            QString fileName = QString::fromStdString(filePath);
+            // Gaps between these are decode plus write time of one entry
+            if (Tracer::isEnabled())
+                Tracer::instance().instant("extract", fileName);
+            QMetaObject::invokeMethod(this, [this, name, fileName, extractedFiles, totalFiles]() {
+                UiMonitor::nameCall("extracted file log");
+                onLogMessage(
+                    QString("%1: %2 (%3 of %4)")
+                        .arg(name)
+                        .arg(fileName)
+                        .arg(extractedFiles->load())
+                        .arg(totalFiles)
+                    );
+            }, Qt::QueuedConnection);
+        });
+
+        std::shared_ptr<CancelToken> token = m_token;
+        extractor.setProgressCallback([this, name, totalSize, readAhead, token](uint64_t processedSize) -> bool {
+            // Paused extraction waits here; a cancel wakes it
+            bool proceed = token->waitWhilePaused();
+            if (proceed) {
+                LowImpact::waitWhileBusy([token]() { return token->isCanceled(); });
+                proceed = !token->isCanceled();
+            }
+            if (!proceed) {
+                token->acknowledge("extract " + name);
+                return false; // Stops extraction
+            }
+
+            if (totalSize > 0)
+                readAhead->advance(qint64(double(readAhead->size()) * processedSize / totalSize));
+
+            QMetaObject::invokeMethod(this, [this, name, processedSize, totalSize]() {
+                UiMonitor::nameCall("extraction progress");
+                onExtractionProgress(name, processedSize, totalSize);
+            }, Qt::QueuedConnection);
+            return true; // continue extraction
+        });
+
+        QDir().mkpath(outputDir);
+        if (index.pending.size() == index.items) {
+            extractor.extract(archivePath.toStdString(), outputDir.toStdString());
+        } else if (!index.pending.empty()) {
+            // Upgrade: only what changed since the installed version
+            extractor.extractItems(archivePath.toStdString(), index.pending, outputDir.toStdString());
+        }
+    } catch (const bit7z::BitException& e) {
+        error = QString::fromUtf8(e.what());
+        return false;
+    }
+
+    return true;
+}
+
+bool MainWindow::fixPermissions(const QString& installDir, QString &error) {
+#ifdef Q_OS_LINUX
+    QString exePath = QDir::cleanPath(installDir + "/ScrutaNet-Server-GUI");
+
+    QFile file(exePath);
+    if (!file.exists()) {
+        // Not every component set ships the GUI
+        qDebug() << "File does not exist:" << exePath;
+        return true;
+    }
+
+    // Set permissions rwxr-xr-x = 755
+    QFileDevice::Permissions perms = QFileDevice::ReadOwner
+                                     | QFileDevice::WriteOwner
+                                     | QFileDevice::ExeOwner
+                                     | QFileDevice::ReadGroup
+                                     | QFileDevice::ExeGroup
+                                     | QFileDevice::ReadOther
+                                     | QFileDevice::ExeOther;
+
+    if (!file.setPermissions(perms)) {
+        error = "Failed to set permissions on " + exePath;
+        return false;
+    }
+    qDebug() << "Permissions set to 755 for" << exePath;
+#else
+    Q_UNUSED(installDir);
+    Q_UNUSED(error);
+#endif
+    return true;
+}
+
+// What the last page offers to start, relative to the installation
+static QString launchExecutable() {
+#ifdef Q_OS_WIN
+    return "ScrutaNet-Server-GUI.exe";
+#else
+    return "ScrutaNet-Server-GUI";
+#endif
+}
+
+// Pulls the program started at the end and its libraries into the page
+// cache while permissions are fixed, so its first start does not wait for
+// the disk. Runs before commit; the rename keeps cached pages with the files.
+void MainWindow::warmLaunchFiles(const QString& installDir) {
+    TraceScope trace("launch", "warm start");
+    static const QRegularExpression library("\\.(so(\\.\\d+)*|dll|dylib)$");
+    QStringList candidates = {launchExecutable()};
+    for (const QString &path : InstalledState::load(installDir).files()) {
+        if (library.match(path).hasMatch())
+            candidates << path;
+    }
+
+    QStringList files;
+    qint64 total = 0;
+    for (const QString &path : std::as_const(candidates)) {
+        QFileInfo info(installDir + "/" + path);
+        if (!info.isFile() || total + info.size() > warmStartBudget)
+            continue;
+        files << info.filePath();
+        total += info.size();
+    }
+    if (files.isEmpty())
+        return;
+
+    auto cached = [&files]() {
+        qint64 bytes = 0;
+        for (const QString &file : std::as_const(files))
+            bytes += qMax<qint64>(0, ReadAhead::cachedBytes(file));
+        return bytes;
+    };
+    QElapsedTimer timer;
+    timer.start();
+    qint64 before = cached();
+    // One file per worker keeps several reads in flight
+    QtConcurrent::blockingMap(files, [](const QString &file) { ReadAhead::willNeed(file); });
+    qDebug() << "Warm start:" << files.size() << "files," << humanSize(total) << "-"
+             << humanSize(before) << "were cached," << humanSize(cached()) << "now, in" << timer.elapsed() << "ms";
+}
+
+bool MainWindow::launchInstalledApp(const QString& installDir, QString &error) {
+    QString exePath = QDir::cleanPath(installDir + "/" + launchExecutable());
+
+    if (!QFile::exists(exePath)) {
+        error = "File does not exist: " + exePath;
+        return false;
+    }
+    if (!QProcess::startDetached(exePath, {}, installDir)) {
+        error = "Failed to start: " + exePath;
+        return false;
+    }
+    return true;
+}
+
+// Builds the install as a task graph and lets the wizard follow along. Every
+// component in the plan, or every volume of a split one, gets its own chain,
+// so payloads download at the same time and each one is extracted as soon as
+// it is verified:
+//
+//   storage -> download:<c> -> verify:<c> -> scan:<c> -> extract:<c> -> carry -+-> record ------+-> commit -> launch
+//                                     codec --^    stage --^                    +-> permissions -+  confirm-launch --^
+//                                                                                    record -> warm --> commit
+//   codec -> preflight:<c> -> preflight -> carry  (header-only listing via range requests, while the body downloads)
+//                    stage --^
+//
+// Everything is written to <install>.staging and only swapped in by commit, so
+// a failed or canceled upgrade leaves the installed version untouched. Files
+// that did not change since that version are reflinked or hard linked
+// instead of extracted, and copied only where neither works.
+// Payloads live in the shared PayloadCache and are only downloaded on a miss.
+// How many extractions run at once follows the storage profile; downloads
+// only hold back in low-impact mode.
+// Volumes are deleted once extracted, and a volume's download waits for the
+// extraction of the one volumeWindow before it, which bounds the disk space a
+// split payload needs.
+void MainWindow::startInstallEngine() {
+    if (m_engine && m_engine->isRunning()) {
+        qWarning() << "Installation is already running";
+        return;
+    }
+    if (m_engine) {
+        m_engine->deleteLater();
+    }
+    qDeleteAll(m_downloads);
+    m_downloads.clear();
+    m_progress.clear();
+    m_extractTimer.invalidate();
+    m_token = std::make_shared<CancelToken>();
+    std::shared_ptr<CancelToken> token = m_token;
+
+    m_engine = new InstallEngine(this);
+    m_engine->setThreadPool(&m_installPool);
+    m_engine->setGroupLimit("download:", downloadLimit());
+    m_engine->setGroupLimit("extract:", m_storageProfile.extractionWorkers);
+    QString outputDir = QDir(ui->txtInstallationPath->toPlainText()).absolutePath();
+
+    // Nothing to stage when everything is up to date
+    auto staged = std::make_shared<StagedInstall>(outputDir);
+    auto installed = std::make_shared<InstalledState>();
+    bool staging = !m_plan.isEmpty();
+    m_staged = staging ? staged : nullptr;
+    QString targetDir = staging ? staged->stagingDir() : outputDir;
+
+    // Reuse the background probe when it already covers this path
+    auto storage = std::make_shared<StorageProfile>(m_storageProfile);
+    m_engine->addTask("storage", {}, [this, storage, outputDir, token](QString &) {
+        if (storage->path != outputDir) {
+            *storage = StorageProbe::probe(outputDir, [token]() { return token->isCanceled(); });
+            StorageProfile profile = *storage;
+            QMetaObject::invokeMethod(this, [this, profile]() {
+                UiMonitor::nameCall("storage profile");
+                applyStorageProfile(profile);
+            }, Qt::QueuedConnection);
+        }
+        return true;
+    });
+
+    m_engine->addTask("codec", {}, [this](QString &error) {
+        dllPath = extractEmbeddedDll();
+        if (dllPath.isEmpty()) {
+            error = "Failed to extract 7z.dll";
+            return false;
+        }
+        return true;
+    });
+
+    m_engine->addTask("stage", {}, [staged, installed, staging](QString &error) {
+        *installed = InstalledState::load(staged->installDir());
+        return !staging || staged->begin(error);
+    });
+
+    QStringList extractTasks;
+    QStringList preflightTasks;
+    QList<QPair<QString, std::shared_ptr<ArchiveIndex>>> previews;
+    qint64 payloadBytes = 0;
+    QList<Component> planned;
+    QHash<QString, QList<std::shared_ptr<ArchiveIndex>>> indexes;
+    EntryFilter filter = m_filter;
+    DedupMode dedup = m_dedup;
+    for (const QString &componentName : std::as_const(m_plan)) {
+        const Component &whole = *m_manifest.component(componentName);
+        QString password = whole.password.isEmpty() ? archivePassword : whole.password;
+        planned << whole;
+
+        // Volumes are installed one by one as they arrive, at most
+        // volumeWindow of them on disk at a time
+        const QList<Component> parts = whole.payloads();
+        bool split = parts.size() > 1;
+        for (int i = 0; i < parts.size(); ++i) {
+            const Component &component = parts[i];
+            QString name = component.name;
+            QString archivePath = payloadPath(component);
+            m_progress[name].downloadTotal = component.size;
+
+            QString key = PayloadCache::keyFor(component);
+            DownloadManager *dm = new DownloadManager(component.url, archivePath, token, this);
+            m_downloads.insert(name, dm);
+            connect(dm, &DownloadManager::progress, this, [this, name](qint64 downloaded, qint64 total, double speed, int) {
+                UiMonitor::nameCall("download progress");
+                onDownloadProgress(name, downloaded, total, speed);
+            });
+            connect(dm, &DownloadManager::retrying, this, [this, name](int failures, qint64 delayMs, const QString &reason) {
+                UiMonitor::nameCall("download retry");
+                ui->retryLabel->setText(QString("%1: %2, reconnecting in %3 s (retry %4)")
+                                            .arg(name, reason)
+                                            .arg(delayMs / 1000.0, 0, 'f', 1)
+                                            .arg(failures));
             });
 
-            extractor.setProgressCallback([this, totalSize, timer](uint64_t processedSize) -> bool {
-                if (m_cancelExtraction.load(std::memory_order_relaxed)) {
-                    qDebug() << "Extraction canceled by user.";
-                    //(archivePath);
-                    ("7z.dll");
-                    return false; // Stops extraction
+            QStringList downloadDeps = {"storage"};
+            if (i >= volumeWindow)
+                downloadDeps << "extract:" + parts[i - volumeWindow].name;
+            bool inPlace = extractsInPlace(component);
+            m_engine->addTask("download:" + name, downloadDeps, [this, dm, component, key, storage, inPlace, token](QString &error) {
+                if (inPlace) {
+                    qDebug() << "Extracting" << component.name << "in place from" << DownloadManager::localPath(component.url);
+                    return true;
                 }
+                auto lock = m_cache.lock(key, [token]() { return token->isCanceled(); });
+                if (!lock) {
+                    error = "Download of " + component.name + " canceled";
+                    return false;
+                }
+
+                // With neither hash nor size the server has the last word on what is current
+                qint64 expected = component.size;
+                if (expected <= 0 && component.sha256.isEmpty())
+                    expected = DownloadManager::remoteFileSize(component.url, token.get());
 
-                std::unique_lock<std::mutex> lock(m_pauseMutex);
-                m_pauseCv.wait(lock, [this]() { return !m_pauseExtraction.load(); });
-                lock.unlock();
-
-                int percent = totalSize > 0 ? static_cast<int>((processedSize * 100) / totalSize) : 0;
-
-                // Calculate time remaining
-                qint64 elapsedMs = timer.elapsed();
-                double elapsedSec = elapsedMs / 1000.0;
-                QString remainingText = "Calculating...";
-                if (elapsedSec > 0 && processedSize > 0) {
-                    double speed = processedSize / elapsedSec; // bytes/sec
-                    double remainingSec = (totalSize - processedSize) / speed;
-                    int minutes = static_cast<int>(remainingSec) / 60;
-                    int seconds = static_cast<int>(remainingSec) % 60;
-                    remainingText = QString("Estimated Time Remaining: %1:%2")
-                                        .arg(minutes, 2, 10, QLatin1Char('0'))
-                                        .arg(seconds, 2, 10, QLatin1Char('0'));
+                // Verify checks the content, so a cache hit needs no network at all
+                if (m_cache.isComplete(key, expected)) {
+                    qDebug() << "Payload cache hit for" << component.name;
+                    m_cache.touch(key);
+                    return true;
+                }
+                if (expected > 0)
+                    dm->setExpectedTotal(expected);
+                dm->setBufferSize(MemoryBudget::instance().bufferSize(storage->bufferSize));
+                dm->start();
+                if (!dm->succeeded()) {
+                    error = "Download of " + component.name + " failed";
+                    return false;
                 }
+                return true;
+            });
+            m_engine->addTask("verify:" + name, {"download:" + name}, [this, component](QString &error) {
+                return prepareArchive(component, error);
+            });
 
-                QMetaObject::invokeMethod(this, [this, percent, remainingText]() {
-                    ui->progressBar->setValue(percent);
-                    ui->labelTime->setText(remainingText);
-                }, Qt::QueuedConnection);
-                return true; // continue extraction
+            // Listed from its header while the body downloads; only a
+            // preview, scan:<c> lists the real file again
+            auto preview = std::make_shared<ArchiveIndex>();
+            previews.append({name, preview});
+            m_engine->addTask("preflight:" + name, {"codec"}, [this, component, password, filter, preview, token](QString &) {
+                QString error;
+                if (!preflightArchive(component, password, filter, *preview, error, token.get())) {
+                    qDebug() << "Preflight of" << component.name << "skipped:" << error;
+                    *preview = ArchiveIndex();
+                }
+                return true;
             });
+            preflightTasks << "preflight:" + name;
+            if (!inPlace && !m_cache.isComplete(key, component.size))
+                payloadBytes += component.size;
+
+            auto index = std::make_shared<ArchiveIndex>();
+            indexes[componentName].append(index);
+            m_engine->addTask("scan:" + name, {"codec", "verify:" + name},
+                              [this, archivePath, password, filter, index](QString &error) {
+                return scanArchive(archivePath, password, filter, *index, error);
+            });
+            m_engine->addTask("extract:" + name, {"stage", "scan:" + name},
+                              [this, name, archivePath, key, split, inPlace, staged, installed, password, index, dedup, token](QString &error) {
+                if (!carryOverUnchanged(name, *staged, *installed, *index, error))
+                    return false;
+                planDuplicates(name, dedup, *index);
+                // Under a memory budget, big dictionaries take turns
+                qint64 reserve = extractOverhead + qint64(index->decoderMemory > 0 ? index->decoderMemory : unknownDictionary);
+                if (!MemoryBudget::instance().acquire(reserve, *token)) {
+                    error = "Extraction of " + name + " canceled";
+                    return false;
+                }
+                bool extracted = extractResourceArchive(name, archivePath, staged->stagingDir(), password, *index, error)
+                                 && materializeDuplicates(archivePath, password, staged->stagingDir(), *index, dedup, error);
+                MemoryBudget::instance().release(reserve);
+                if (!extracted)
+                    return false;
+                // The next volume's download is waiting for the space
+                if (split && !inPlace) {
+                    auto lock = m_cache.lock(key, [token]() { return token->isCanceled(); });
+                    if (lock)
+                        QFile::remove(archivePath);
+                }
+                return true;
+            });
+            extractTasks << "extract:" + name;
+        }
+    }
 
-            QDir().mkpath(outputDir);
-            extractor.extract(archivePath.toStdString(), outputDir.toStdString());
+    // Seconds into the install: does it fit, and the directory tree ready
+    // before the first file is extracted. Staging is gone once committed,
+    // so carry waits for this.
+    m_engine->setGroupLimit("preflight:", 4);
+    QStringList plannedNames = m_plan;
+    m_engine->addTask("preflight", QStringList(preflightTasks) << "stage",
+                      [this, previews, staged, installed, staging, plannedNames, payloadBytes](QString &error) {
+        uint64_t bytes = 0;
+        size_t files = 0;
+        int listed = 0;
+        QSet<QString> dirs;
+        QStringList layout;
+        for (const auto &preview : previews) {
+            const ArchiveIndex &index = *preview.second;
+            if (index.items == 0)
+                continue;
+            listed++;
+            bytes += index.size;
+            files += index.files;
+            layout << QString("%1: %2 files, %3").arg(preview.first).arg(index.files).arg(humanSize(index.size));
+            for (const ArchiveEntry &entry : index.entries)
+                dirs.insert(entry.isDir ? entry.path : QFileInfo(entry.path).path());
+        }
+        if (listed == 0)
+            return true;
+
+        // Payloads still to come take space too when the cache shares the disk
+        QStorageInfo target(staged->stagingDir());
+        qint64 needed = qint64(bytes);
+        if (QStorageInfo(m_cache.dir()).device() == target.device())
+            needed += payloadBytes;
+        // The files the upgrade keeps are carried into staging; without
+        // reflinks or hard links that is a full copy of each
+        if (staging && !staged->canLink()) {
+            const QStringList kept = installed->files();
+            for (const QString &path : kept) {
+                const InstalledState::File *file = installed->file(path);
+                if (file && !plannedNames.contains(file->component))
+                    needed += qint64(file->size);
+            }
+        }
+        if (listed == previews.size() && target.isValid() && needed > target.bytesAvailable()) {
+            error = QString("Not enough disk space in %1: the install needs %2, %3 are free")
+                        .arg(staged->installDir(), humanSize(needed), humanSize(target.bytesAvailable()));
+            return false;
+        }
 
-            QMetaObject::invokeMethod(this, [this]() {
-                qDebug() << "Extraction Completed!";
-                ui->lblInstallationStatus->setText("Installing Completed.");
-                ui->nextButton->setDisabled(false);
-                ui->backButton->setDisabled(true);
-                ui->labelTime->setText("Installation Completed.");
-                ui->cancelInstallationButton->setDisabled(true);
-                ui->resumeInstallationButton->setDisabled(true);
-                if (QFile::exists(dllPath)) {
-                    QFile::remove(dllPath);
-                }
-            }, Qt::QueuedConnection);
+        for (const QString &dir : std::as_const(dirs)) {
+            if (dir != "." && !QDir().mkpath(staged->stagingDir() + "/" + dir))
+                qDebug() << "Preflight: cannot create" << dir;
+        }
 
-        } catch (const bit7z::BitException& e) {
-            QMetaObject::invokeMethod(this, [this]() {
-                if (m_cancelExtraction.load(std::memory_order_relaxed)) {
-                    ui->lblInstallationStatus->setText("Extraction Canceled.");
-                    ui->progressBar->setValue(0);
-                    ui->nextButton->setDisabled(true);
-                    ui->backButton->setDisabled(true);
-                    ui->cancelInstallationButton->setDisabled(true);
-                    ui->resumeInstallationButton->setDisabled(true);
-                    if (QFile::exists(filePath)) {
-                        QFile::remove(dllPath);
+        QString summary = QString("%1 files, %2 to install, %3 needed on disk (%4 of %5 payloads listed)")
+                              .arg(files).arg(humanSize(bytes), humanSize(needed)).arg(listed).arg(previews.size());
+        qDebug().noquote() << "Preflight:" << summary << "\n  " + layout.join("\n  ");
+        QMetaObject::invokeMethod(this, [this, summary]() {
+            UiMonitor::nameCall("preflight summary");
+            ui->textEditInstallationLogs->append("[Preflight]: " + summary);
+        }, Qt::QueuedConnection);
+        return true;
+    });
+
+    // Everything the upgraded components do not own anymore stays behind;
+    // other components and the user's own files come along
+    QString selection = m_filter.key();
+    m_engine->addTask("carry", QStringList(extractTasks) << "stage" << "preflight", [staged, installed, staging, plannedNames, token](QString &error) {
+        if (!staging)
+            return true;
+        return staged->carryOverRemaining([installed, plannedNames](const QString &path) {
+            const InstalledState::File *file = installed->file(path);
+            return file && plannedNames.contains(file->component);
+        }, error, [token]() { return token->isCanceled(); });
+    });
+    m_engine->addTask("record", {"carry"}, [planned, indexes, installed, targetDir, selection](QString &error) {
+        InstalledState state = *installed;
+        for (const Component &component : planned) {
+            QList<ArchiveEntry> entries;
+            for (const auto &index : indexes.value(component.name))
+                entries += index->entries;
+            state.record(component, selection);
+            state.recordFiles(component.name, entries);
+        }
+        if (!state.save(targetDir)) {
+            error = "Failed to record installed components in " + targetDir;
+            return false;
+        }
+        return true;
+    });
+    m_engine->addTask("permissions", {"carry"}, [this, targetDir](QString &) {
+        // A missing exec bit is not worth rolling the whole install back for
+        QString error;
+        if (!fixPermissions(targetDir, error))
+            qDebug() << error;
+        return true;
+    });
+    // Warm reads from staging, so commit (which renames it) waits for it;
+    // it still overlaps the permission fix-up
+    QStringList commitDeps = {"record", "permissions"};
+    if (m_warmStart) {
+        m_engine->addTask("warm", {"record"}, [this, targetDir](QString &) {
+            warmLaunchFiles(targetDir);
+            return true;
+        });
+        commitDeps << "warm";
+    }
+    m_engine->addTask("commit", commitDeps, [staged, staging](QString &error) {
+        return !staging || staged->commit(error);
+    });
+    bool deletePayloads = m_deletePayloads;
+    m_engine->addTask("trim-cache", {"commit"}, [this, planned, deletePayloads, token](QString &) {
+        if (deletePayloads) {
+            for (const Component &component : planned) {
+                for (const Component &part : component.payloads()) {
+                    // Another installer using the payload keeps it; give up
+                    // after a short wait instead of blocking the install
+                    QString key = PayloadCache::keyFor(part);
+                    QElapsedTimer waited;
+                    waited.start();
+                    auto lock = m_cache.lock(key, [token, &waited]() {
+                        return token->isCanceled() || waited.elapsed() > deletePayloadWaitMs;
+                    });
+                    if (!lock) {
+                        qDebug() << "Kept payload of" << part.name << "- in use by another installer";
+                        continue;
                     }
-                    QApplication::quit();
-                } else {
-                    ui->lblInstallationStatus->setText("An error has occured during installation. Please run installer as Administrator.");
-                    ui->progressBar->setValue(0);
-                    ui->nextButton->setDisabled(true);
-                    ui->backButton->setDisabled(true);
-                    ui->cancelInstallationButton->setDisabled(true);
-                    ui->resumeInstallationButton->setDisabled(true);
-                    setWindowFlags(windowFlags() | Qt::WindowCloseButtonHint);
-                    show();
+                    if (QFile::remove(m_cache.pathFor(key)))
+                        qDebug() << "Deleted payload of" << part.name;
                 }
-            }, Qt::QueuedConnection);
-            QMetaObject::invokeMethod(this, [msg = QString::fromUtf8(e.what())]() {
-                if (!m_cancelExtraction.load(std::memory_order_relaxed)) {
-                    QMessageBox::critical(nullptr, "Error", msg);
-                }
-            }, Qt::QueuedConnection);
+            }
+        }
+        m_cache.trim();
+        return true;
+    });
+    m_engine->addGate("confirm-launch");
+    m_engine->addTask("launch", {"commit", "confirm-launch"}, [this, outputDir](QString &error) {
+        return launchInstalledApp(outputDir, error);
+    });
+
+    // Whatever a failed run staged is useless; the next run would clear it anyway
+    connect(m_engine, &InstallEngine::finished, this, [this](bool success) {
+        if (!success)
+            discardPartialInstall(false);
+        qint64 budget = MemoryBudget::instance().limit();
+        qDebug().noquote() << QString("Install %1, peak RSS %2%3")
+                                  .arg(success ? "finished" : "stopped", humanSize(peakRssBytes()),
+                                       budget > 0 ? " of a " + humanSize(budget) + " budget" : QString());
+    });
+
+    adoptPrefetches();
+
+    connect(m_engine, &InstallEngine::taskStarted, this, &MainWindow::onTaskStarted);
+    connect(m_engine, &InstallEngine::taskFinished, this, &MainWindow::onTaskFinished);
+    connect(m_engine, &InstallEngine::taskFailed, this, &MainWindow::onTaskFailed);
+
+    m_engine->start();
+}
+
+bool MainWindow::downloadsOutstanding() const {
+    for (auto it = m_downloads.cbegin(); it != m_downloads.cend(); ++it) {
+        const QString &name = it.key();
+        InstallEngine::TaskState state = m_engine->taskState("download:" + name);
+        if (state == InstallEngine::TaskState::Pending || state == InstallEngine::TaskState::Running)
+            return true;
+    }
+    return false;
+}
+
+void MainWindow::showInstallationPage() {
+    if (ui->tabWidget->currentIndex() == 3)
+        return;
+    ui->tabWidget->setCurrentIndex(3);
+    ui->lblInstallationStatus->setText("Installing...");
+    ui->nextButton->setDisabled(true);
+    ui->backButton->setDisabled(true);
+}
+
+void MainWindow::onTaskStarted(const QString &id) {
+    if (id.startsWith("extract:")) {
+        if (!m_extractTimer.isValid())
+            m_extractTimer.start();
+        // Stay on the download page while other components are still arriving
+        if (!downloadsOutstanding())
+            showInstallationPage();
+    }
+}
+
+void MainWindow::onTaskFinished(const QString &id, qint64 elapsedMs) {
+    Q_UNUSED(elapsedMs);
+
+    if (id.startsWith("download:") && !downloadsOutstanding()) {
+        ui->progressBarDownload->setValue(100);
+        ui->retryLabel->setText("");
+        ui->sizeLabel->setText("");
+        ui->etaLabel->setText("Download Complete.");
+        ui->speedLabel->setText("");
+        ui->startDownloadButton->setDisabled(true);
+        ui->resumeDownloadButton->setDisabled(true);
+        ui->cancelDownloadButton->setDisabled(true);
+        if (m_extractTimer.isValid())
+            showInstallationPage();
+    } else if (id.startsWith("extract:")) {
+        onLogMessage(id.mid(8) + " installed.");
+    } else if (id == "commit") {
+        qDebug() << "Extraction Completed!";
+        if (m_benchmark) {
+            finishBenchmark(true);
+            return;
+        }
+        showInstallationPage();
+        ui->progressBar->setValue(100);
+        ui->lblInstallationStatus->setText(m_plan.isEmpty() ? "Already up to date." : "Installing Completed.");
+        ui->nextButton->setDisabled(false);
+        ui->backButton->setDisabled(true);
+        ui->labelTime->setText("Installation Completed.");
+        ui->cancelInstallationButton->setDisabled(true);
+        ui->resumeInstallationButton->setDisabled(true);
+        if (QFile::exists(dllPath)) {
+            QFile::remove(dllPath);
+        }
+    }
+}
+
+void MainWindow::onTaskFailed(const QString &id, const QString &msg) {
+    if (m_benchmark) {
+        // Tasks failing is what canceling looks like
+        if (m_benchmarkCancelMs > 0 && m_token->isCanceled())
+            return;
+        qWarning() << id << "failed:" << msg;
+        finishBenchmark(false);
+        return;
+    }
+
+    if (id.startsWith("download:")) {
+        qWarning() << "Download error:" << msg;
+        cancelInstall();
+        quitWhenStopped();
+        return;
+    }
+
+    if (id == "launch") {
+        qDebug() << msg;
+        return;
+    }
+
+    // One failed component stops the others
+    bool canceled = m_token->isCanceled() || m_engine->isCancelled();
+    cancelInstall();
+
+    if (canceled) {
+        ui->lblInstallationStatus->setText("Extraction Canceled.");
+        ui->progressBar->setValue(0);
+        ui->nextButton->setDisabled(true);
+        ui->backButton->setDisabled(true);
+        ui->cancelInstallationButton->setDisabled(true);
+        ui->resumeInstallationButton->setDisabled(true);
+        quitWhenStopped();
+    } else {
+        ui->tabWidget->setCurrentIndex(3);
+        ui->lblInstallationStatus->setText("An error has occured during installation. Please run installer as Administrator.");
+        ui->progressBar->setValue(0);
+        ui->nextButton->setDisabled(true);
+        ui->backButton->setDisabled(true);
+        ui->cancelInstallationButton->setDisabled(true);
+        ui->resumeInstallationButton->setDisabled(true);
+        setWindowFlags(windowFlags() | Qt::WindowCloseButtonHint);
+        show();
+        QMessageBox::critical(nullptr, "Error", msg);
+    }
+}
+
+void MainWindow::onDownloadProgress(const QString &name, qint64 downloaded, qint64 total, double speed) {
+    ComponentProgress &progress = m_progress[name];
+    progress.downloaded = downloaded;
+    progress.downloadTotal = total;
+    progress.speed = speed;
+
+    qint64 sumDownloaded = 0;
+    qint64 sumTotal = 0;
+    double sumSpeed = 0;
+    for (const ComponentProgress &p : std::as_const(m_progress)) {
+        sumDownloaded += p.downloaded;
+        sumTotal += p.downloadTotal;
+        sumSpeed += p.speed;
+    }
+
+    int percent = (sumTotal > 0) ? static_cast<int>((sumDownloaded * 100) / sumTotal) : 0;
+    int eta = (sumSpeed > 0) ? static_cast<int>((sumTotal - sumDownloaded) / (sumSpeed * 1024 * 1024)) : -1;
+    ui->progressBarDownload->setValue(percent);
+    ui->sizeLabel->setText(QString("%1 / %2")
+                               .arg(humanSize(sumDownloaded))
+                               .arg(humanSize(sumTotal)));
+    ui->speedLabel->setText(QString("Speed: %1 MB/s").arg(sumSpeed, 0, 'f', 2));
+    ui->etaLabel->setText(QString("ETA: %1 sec").arg(eta >= 0 ? eta : -1));
+}
+
+void MainWindow::onExtractionProgress(const QString &name, uint64_t processed, uint64_t total) {
+    ComponentProgress &progress = m_progress[name];
+    progress.extracted = processed;
+    progress.extractTotal = total;
+
+    uint64_t sumProcessed = 0;
+    uint64_t sumTotal = 0;
+    for (const ComponentProgress &p : std::as_const(m_progress)) {
+        sumProcessed += p.extracted;
+        sumTotal += p.extractTotal;
+    }
+
+    int percent = sumTotal > 0 ? static_cast<int>((sumProcessed * 100) / sumTotal) : 0;
+
+    // Calculate time remaining
+    qint64 elapsedMs = m_extractTimer.isValid() ? m_extractTimer.elapsed() : 0;
+    double elapsedSec = elapsedMs / 1000.0;
+    QString remainingText = "Calculating...";
+    if (elapsedSec > 0 && sumProcessed > 0) {
+        double speed = sumProcessed / elapsedSec; // bytes/sec
+        double remainingSec = (sumTotal - sumProcessed) / speed;
+        int minutes = static_cast<int>(remainingSec) / 60;
+        int seconds = static_cast<int>(remainingSec) % 60;
+        remainingText = QString("Estimated Time Remaining: %1:%2")
+                            .arg(minutes, 2, 10, QLatin1Char('0'))
+                            .arg(seconds, 2, 10, QLatin1Char('0'));
+    }
+
+    ui->progressBar->setValue(percent);
+    ui->labelTime->setText(remainingText);
+}
+
+// Fetches the component manifest in the background. Servers that only
+// publish a single payload get a one-component manifest instead.
+void MainWindow::loadManifest() {
+    auto *watcher = new QFutureWatcher<Manifest>(this);
+    connect(watcher, &QFutureWatcher<Manifest>::finished, this, [this, watcher]() {
+        m_manifest = watcher->result();
+        watcher->deleteLater();
+        m_manifestReady = true;
+        populateComponents();
+        if (ui->tabWidget->currentIndex() == 1)
+            ui->nextButton->setDisabled(false);
+        startPrefetch();
+    });
+    QString source = m_source;
+    watcher->setFuture(QtConcurrent::run([source]() {
+        QByteArray data;
+        QString error;
+        Manifest manifest;
+        // A mirror or local media carries the same files as the server
+        QString from = source.isEmpty() ? manifestUrl : source + "/" + QUrl(manifestUrl).fileName();
+        if (DownloadManager::fetch(from, data, error) && Manifest::fromJson(data, manifest, error)) {
+            qDebug() << "Loaded manifest" << manifest.version << "with" << manifest.components.size() << "components";
+        } else {
+            qWarning() << error << "- using the single payload";
+            manifest = Manifest::singlePayload(url, "Data.bin", ":/data/Data.bin");
+        }
+        if (!source.isEmpty())
+            manifest.rebase(source);
+        return manifest;
+    }));
+}
+
+// Starts fetching what the default selection needs as soon as the manifest
+// is known, while the user is still on the first pages. Payloads go to the
+// shared cache, which does not depend on the install path, and at a polite
+// rate; the install's download tasks pick them up from there.
+void MainWindow::startPrefetch() {
+    if (!m_prefetches.isEmpty() || (m_engine && m_engine->isRunning()))
+        return;
+
+    for (const Component &whole : std::as_const(m_manifest.components)) {
+        if (!whole.required && !whole.selectedByDefault)
+            continue;
+        // Only the first volumes; the install deletes them as it goes
+        const QList<Component> parts = whole.payloads().mid(0, volumeWindow);
+        for (const Component &component : parts) {
+            if (extractsInPlace(component))
+                continue;
+            QString key = PayloadCache::keyFor(component);
+            if (m_cache.isComplete(key, component.size))
+                continue;
+
+            auto token = std::make_shared<CancelToken>();
+            DownloadManager *dm = new DownloadManager(component.url, m_cache.pathFor(key), token, this);
+            dm->setRateLimit(prefetchRateLimit);
+            if (component.size > 0)
+                dm->setExpectedTotal(component.size);
+            auto fullSpeed = std::make_shared<std::atomic<bool>>(false);
+            m_prefetches.insert(component.name, {dm, token, whole.name, false, fullSpeed});
+
+            // Once the install wants it, the download thread takes back
+            // normal priority itself (it is the one its priority applies to)
+            auto raised = std::make_shared<bool>(false);
+            connect(dm, &DownloadManager::progress, dm, [fullSpeed, raised]() {
+                if (*raised || !fullSpeed->load())
+                    return;
+                *raised = true;
+                LowImpact::setThreadBackground(LowImpact::isEnabled());
+            }, Qt::DirectConnection);
+
+            QString name = component.name;
+            m_prefetchPool.start([this, dm, token, key, name]() {
+                auto lock = m_cache.lock(key, [token]() { return token->isCanceled(); });
+                if (!lock || m_cache.isComplete(key, 0))
+                    return;
+                TraceScope trace("download", "prefetch", name);
+                // Polite whatever the mode: the user is busy with the wizard
+                LowImpact::setThreadBackground(true);
+                qDebug() << "Prefetching" << name;
+                dm->start();
+                LowImpact::setThreadBackground(LowImpact::isEnabled());
+            });
         }
+    }
+}
 
-        //(archivePath);
+// The install wants these now: full speed, and show them as its downloads.
+// Prefetches the user deselected are stopped; what they got stays resumable.
+void MainWindow::adoptPrefetches() {
+    for (auto it = m_prefetches.begin(); it != m_prefetches.end(); ++it) {
+        if (!m_plan.contains(it->component)) {
+            it->token->cancel();
+            continue;
+        }
+        it->download->setRateLimit(0);
+        it->fullSpeed->store(true);
+        if (it->adopted)
+            continue;
+        it->adopted = true;
+        QString name = it.key();
+        connect(it->download, &DownloadManager::progress, this, [this, name](qint64 downloaded, qint64 total, double speed, int) {
+            UiMonitor::nameCall("download progress");
+            onDownloadProgress(name, downloaded, total, speed);
+        });
+    }
+}
+
+// Drives the wizard the way a user would, so the numbers include the real
+// signal traffic of downloads, extraction and the log
+void MainWindow::runBenchmark(const QString &installDir) {
+    m_benchmark = true;
+    ui->txtInstallationPath->setPlainText(installDir);
+    UiMonitor::instance().start();
+    UiMonitor::instance().reset();
+
+    auto *step = new QTimer(this);
+    connect(step, &QTimer::timeout, this, [this, step]() {
+        int page = ui->tabWidget->currentIndex();
+        if (page == 0 || (page == 1 && m_manifestReady)) {
+            NextStep();
+        } else if (page >= 2) {
+            step->deleteLater();
+            if (m_benchmarkCancelMs > 0) {
+                QTimer::singleShot(m_benchmarkCancelMs, this, [this]() {
+                    if (!m_engine || !m_engine->isRunning())
+                        return;
+                    qDebug() << "Benchmark: canceling the install";
+                    m_cancelTimer.start();
+                    connect(m_engine, &InstallEngine::finished, this, &MainWindow::finishCancelBenchmark);
+                    cancelInstall();
+                });
+            }
+        }
     });
-    m_extractionWatcher.setFuture(m_extractionFuture);
+    step->start(250);
+}
+
+// Prints how quickly the workers and the engine stopped, and whether the
+// partial install was cleaned up. Fails past CancelToken::boundMs.
+void MainWindow::finishCancelBenchmark() {
+    qint64 stoppedMs = m_cancelTimer.elapsed();
+    qint64 slowestMs = m_token->latencyMs();
+    QString stagingDir = StagedInstall(QDir(ui->txtInstallationPath->toPlainText()).absolutePath()).stagingDir();
+    discardPartialInstall(true);
+    bool clean = !QFileInfo::exists(stagingDir) && !QFile::exists(dllPath);
+
+    QTextStream out(stdout);
+    out << QString("Cancel latency: slowest worker %1 ms, engine stopped after %2 ms, bound %3 ms")
+               .arg(slowestMs).arg(stoppedMs).arg(CancelToken::boundMs) << Qt::endl;
+    out << (clean ? "Partial install removed" : "Partial install left behind: " + stagingDir) << Qt::endl;
+    out << UiMonitor::instance().report() << Qt::endl;
+    QCoreApplication::exit(slowestMs <= CancelToken::boundMs && clean ? 0 : 1);
+}
+
+void MainWindow::finishBenchmark(bool success) {
+    if (success && m_benchmarkCancelMs > 0) {
+        qWarning() << "Benchmark: the install finished before the cancel, nothing measured";
+        success = false;
+    }
+    if (m_engine && m_engine->isRunning()) {
+        if (success)
+            m_engine->skipTask("launch");
+        else
+            m_engine->cancel();
+    }
+    QTextStream(stdout) << UiMonitor::instance().report() << Qt::endl;
+    // Let the engine wind down before the event loop goes
+    if (m_engine && m_engine->isRunning())
+        connect(m_engine, &InstallEngine::finished, qApp, [success]() { QCoreApplication::exit(success ? 0 : 1); });
+    else
+        QCoreApplication::exit(success ? 0 : 1);
+}
+
+void MainWindow::cancelInstall() {
+    if (m_token)
+        m_token->cancel();
+    if (m_engine)
+        m_engine->cancel();
+}
+
+void MainWindow::discardPartialInstall(bool wait) {
+    // Only once per install
+    if (std::shared_ptr<StagedInstall> staged = std::move(m_staged))
+        m_cleanup = QtConcurrent::run([staged]() { staged->abort(); });
+    if (!dllPath.isEmpty() && QFile::exists(dllPath))
+        QFile::remove(dllPath);
+    if (wait)
+        m_cleanup.waitForFinished();
+}
+
+// Tasks already running finish their step first; quitting before that
+// would leave their partial output behind
+void MainWindow::quitWhenStopped() {
+    if (m_engine && m_engine->isRunning())
+        connect(m_engine, &InstallEngine::finished, qApp, &QCoreApplication::quit, Qt::QueuedConnection);
+    else
+        QApplication::quit();
+}
+
+void MainWindow::stopPrefetches() {
+    for (const Prefetch &prefetch : std::as_const(m_prefetches))
+        prefetch.token->cancel();
+}
+
+void MainWindow::populateComponents() {
+    QSignalBlocker blocker(ui->listComponents);
+    ui->listComponents->clear();
+    for (const Component &component : std::as_const(m_manifest.components)) {
+        QString label = component.version.isEmpty() ? component.title : component.title + " " + component.version;
+        auto *item = new QListWidgetItem(label, ui->listComponents);
+        item->setData(Qt::UserRole, component.name);
+        item->setFlags(component.required ? Qt::ItemIsEnabled : (Qt::ItemIsEnabled | Qt::ItemIsUserCheckable));
+        item->setCheckState(component.required || component.selectedByDefault ? Qt::Checked : Qt::Unchecked);
+    }
+
+    // "Everything" keeps the component list as it is; profiles may change it
+    {
+        QSignalBlocker profileBlocker(ui->comboProfile);
+        ui->comboProfile->clear();
+        ui->comboProfile->addItem("Everything", QString());
+        for (const Profile &profile : std::as_const(m_manifest.profiles))
+            ui->comboProfile->addItem(profile.title, profile.name);
+        ui->comboProfile->setVisible(!m_manifest.profiles.isEmpty());
+    }
+    int requested = ui->comboProfile->findData(m_requestedProfile);
+    if (!m_requestedProfile.isEmpty() && requested < 0)
+        qWarning() << "Unknown profile" << m_requestedProfile;
+    ui->comboProfile->setCurrentIndex(qMax(0, requested));
+}
+
+void MainWindow::setSelection(const QString &profile, const QStringList &include, const QStringList &exclude) {
+    m_requestedProfile = profile;
+    m_extraInclude = include;
+    m_extraExclude = exclude;
+}
+
+void MainWindow::onProfileChanged(int index) {
+    const Profile *profile = m_manifest.profile(ui->comboProfile->itemData(index).toString());
+    if (!profile || profile->components.isEmpty())
+        return;
+
+    QString error;
+    QStringList needed = m_manifest.resolve(profile->components, error);
+    QSignalBlocker blocker(ui->listComponents);
+    for (int i = 0; i < ui->listComponents->count(); ++i) {
+        QListWidgetItem *item = ui->listComponents->item(i);
+        item->setCheckState(needed.contains(item->data(Qt::UserRole).toString()) ? Qt::Checked : Qt::Unchecked);
+    }
+}
+
+// The current profile's patterns and the ones given on the command line
+EntryFilter MainWindow::selectedFilter() const {
+    QStringList include = m_extraInclude;
+    QStringList exclude = m_extraExclude;
+    if (const Profile *profile = m_manifest.profile(ui->comboProfile->currentData().toString())) {
+        include += profile->include;
+        exclude += profile->exclude;
+    }
+    return EntryFilter(include, exclude);
+}
+
+void MainWindow::onComponentToggled(QListWidgetItem *item) {
+    if (item->checkState() != Qt::Checked)
+        return;
+
+    // Checking a component also checks everything it depends on
+    QString error;
+    QStringList needed = m_manifest.resolve({item->data(Qt::UserRole).toString()}, error);
+    QSignalBlocker blocker(ui->listComponents);
+    for (int i = 0; i < ui->listComponents->count(); ++i) {
+        QListWidgetItem *other = ui->listComponents->item(i);
+        if (needed.contains(other->data(Qt::UserRole).toString()))
+            other->setCheckState(Qt::Checked);
+    }
+}
+
+QStringList MainWindow::selectedComponents() const {
+    QStringList selection;
+    for (int i = 0; i < ui->listComponents->count(); ++i) {
+        QListWidgetItem *item = ui->listComponents->item(i);
+        if (item->checkState() == Qt::Checked)
+            selection << item->data(Qt::UserRole).toString();
+    }
+    return selection;
 }
 
 void MainWindow::onPauseExtraction() {
@@ -328,20 +1707,18 @@ void MainWindow::onPauseExtraction() {
     {
         ui->resumeInstallationButton->setIcon(QIcon(":/icons/Blue-Button.png"));
         resumeInstallationButtonLabel->setText("Resume Installation");
-        std::lock_guard<std::mutex> lock(m_pauseMutex);
-        m_pauseExtraction.store(true);
-        m_pauseCv.notify_one();
+        if (m_token)
+            m_token->setPaused(true);
     } else {
         ui->resumeInstallationButton->setIcon(QIcon(":/icons/Orange-Button.png"));
         resumeInstallationButtonLabel->setText("Pause Installation");
-        std::lock_guard<std::mutex> lock(m_pauseMutex);
-        m_pauseExtraction.store(false);
-        m_pauseCv.notify_one();
+        if (m_token)
+            m_token->setPaused(false);
     }
 }
 
 void MainWindow::onCancelExtraction() {
-    m_cancelExtraction.store(true);
+    cancelInstall();
 }
 
 void MainWindow::NextStep()
@@ -354,75 +1731,14 @@ void MainWindow::NextStep()
     {
         quitApp.store(false);
     }
-    if (ui->tabWidget->currentIndex() == 2) {
+    if (ui->tabWidget->currentIndex() == 1 && !m_manifestReady) {
+        // Components are listed once the manifest has arrived
         ui->nextButton->setDisabled(true);
-        ui->backButton->setDisabled(true);
-
-        filePath = getExeFolder() + fileNameStr;
-        if (QFile::exists(filePath)) {
-            if (QFile::exists(file + ".meta")) {
-                this->onStartClicked();
-            } else {
-                QMessageBox msgBox;
-                msgBox.setIcon(QMessageBox::Question);
-                msgBox.setWindowTitle("File Exists");
-                msgBox.setText("The file already exists. Do you want to overwrite?");
-
-                // Add standard Yes and No buttons
-                msgBox.setStandardButtons(QMessageBox::Yes | QMessageBox::No);
-
-                // Access and style buttons individually
-                QAbstractButton  *yesButton = msgBox.button(QMessageBox::Yes);
-                QAbstractButton  *noButton = msgBox.button(QMessageBox::No);
-
-                yesButton->setObjectName("yesBtn");
-                noButton->setObjectName("noBtn");
-
-                msgBox.setStyleSheet(
-                    "#yesBtn { "
-                    "   background-color: #0078D7; "   // Blue
-                    "   color: white; "
-                    "   border-radius: 6px; "
-                    "   padding: 8px 16px; "
-                    "   font-weight: bold; "
-                    "} "
-                    "#yesBtn:hover { background-color: #005A9E; } "  // Darker blue on hover
-
-                    "#noBtn { "
-                    "   background-color: #FF8C00; "   // Orange
-                    "   color: white; "
-                    "   border-radius: 6px; "
-                    "   padding: 8px 16px; "
-                    "   font-weight: bold; "
-                    "} "
-                    "#noBtn:hover { background-color: #E67300; } "   // Darker orange on hover
-                    );
-
-                // Execute the message box
-                int reply = msgBox.exec();
-
-                if (reply == QMessageBox::Yes) {
-                    QFile::remove(filePath);
-                    this->onStartClicked();
-                } else {
-                    qDebug() << "User chose not to overwrite.";
-                    ui->tabWidget->setCurrentIndex(ui->tabWidget->currentIndex() + 1);
-                }
-            }
-        } else {
-            this->onStartClicked();
-        }
     }
-    if (ui->tabWidget->currentIndex() == 3) {
+    if (ui->tabWidget->currentIndex() == 2) {
         ui->nextButton->setDisabled(true);
         ui->backButton->setDisabled(true);
-        QString outputDir = ui->txtInstallationPath->toPlainText();
-        QDir dir(outputDir);
-        //dir.cdUp();  // Goes one level up (removes the last folder)
-
-        QString parentPath = dir.absolutePath();  // This is the path without the last folder
-        ui->lblInstallationStatus->setText("Installing...");
-        extractResourceArchive(":/data/Data.bin", parentPath, "ah*&62I(FFqwrhg12r089YFDW(213r");
+        this->onStartClicked();
     }
     if (ui->tabWidget->currentIndex() == 4 && !quitApp.load())
     {
@@ -434,55 +1750,17 @@ void MainWindow::NextStep()
     }
     if (ui->tabWidget->currentIndex() == 4 && quitApp.load())
     {
-        if (!ui->cbLaunch->isChecked())
-        {
+        // Launching is the last task of the install graph; leave once it is done
+        if (!m_engine || !m_engine->isRunning()) {
             QApplication::quit();
+            return;
         }
-        else {
-#ifdef Q_OS_WIN
-            QString exePath = QDir::cleanPath(ui->txtInstallationPath->toPlainText() + "/ScrutaNet-Server-GUI.exe");
-
-            QFile file(exePath);
-            if (file.exists()) {
-                bool started = QProcess::startDetached(exePath, {}, ui->txtInstallationPath->toPlainText());
-                if (!started) {
-                    qDebug() << "Failed to start:" << exePath;
-                }
-            } else {
-                qDebug() << "File does not exist:" << exePath;
-            }
-
-#elif defined(Q_OS_LINUX)
-            QString exePath = QDir::cleanPath(ui->txtInstallationPath->toPlainText() + "/ScrutaNet-Server-GUI");
-
-            QFile file(exePath);
-            if (file.exists()) {
-                // Set permissions rwxr-xr-x = 755
-                QFileDevice::Permissions perms = QFileDevice::ReadOwner
-                                                 | QFileDevice::WriteOwner
-                                                 | QFileDevice::ExeOwner
-                                                 | QFileDevice::ReadGroup
-                                                 | QFileDevice::ExeGroup
-                                                 | QFileDevice::ReadOther
-                                                 | QFileDevice::ExeOther;
-
-                bool success = file.setPermissions(perms);
-                if (!success) {
-                    qDebug() << "Failed to set permissions on" << exePath;
-                } else {
-                    qDebug() << "Permissions set to 755 for" << exePath;
-                }
-
-                bool started = QProcess::startDetached(exePath, {}, ui->txtInstallationPath->toPlainText());
-                if (!started) {
-                    qDebug() << "Failed to start:" << exePath;
-                }
-
-            } else {
-                qDebug() << "File does not exist:" << exePath;
-            }
-#endif
-            QApplication::quit();
+        ui->nextButton->setDisabled(true);
+        connect(m_engine, &InstallEngine::finished, qApp, &QApplication::quit);
+        if (ui->cbLaunch->isChecked()) {
+            m_engine->openGate("confirm-launch");
+        } else {
+            m_engine->skipTask("launch");
         }
     }
 }
@@ -497,6 +1775,7 @@ void MainWindow::BackStep()
 
     if (ui->tabWidget->currentIndex() == 0) {
         backButtonLabel->setText("Exit");
+        ui->nextButton->setDisabled(false);
 
         quitApp.store(true);
     } else {
@@ -505,114 +1784,32 @@ void MainWindow::BackStep()
 }
 
 void MainWindow::onStartClicked() {
-    if (url.isEmpty() || file.isEmpty()) {
-        QMessageBox::warning(this, "Input Error", "Please provide both URL and output file path.");
+    if (!m_manifestReady) {
+        QMessageBox::warning(this, "Input Error", "The component list is not available yet.");
         return;
     }
 
-    if (QFile::exists(file + ".meta")) {
-        QMessageBox msgBox;
-        msgBox.setIcon(QMessageBox::Question);
-        msgBox.setWindowTitle("Resume?");
-        msgBox.setText("Resume previous download?");
-
-        // Add standard Yes and No buttons
-        msgBox.setStandardButtons(QMessageBox::Yes | QMessageBox::No);
-
-        // Access and style buttons individually
-        QAbstractButton  *yesButton = msgBox.button(QMessageBox::Yes);
-        QAbstractButton  *noButton = msgBox.button(QMessageBox::No);
-
-        yesButton->setObjectName("yesBtn");
-        noButton->setObjectName("noBtn");
-
-        msgBox.setStyleSheet(
-            "#yesBtn { "
-            "   background-color: #0078D7; "   // Blue
-            "   color: white; "
-            "   border-radius: 6px; "
-            "   padding: 8px 16px; "
-            "   font-weight: bold; "
-            "} "
-            "#yesBtn:hover { background-color: #005A9E; } "  // Darker blue on hover
-
-            "#noBtn { "
-            "   background-color: #FF8C00; "   // Orange
-            "   color: white; "
-            "   border-radius: 6px; "
-            "   padding: 8px 16px; "
-            "   font-weight: bold; "
-            "} "
-            "#noBtn:hover { background-color: #E67300; } "   // Darker orange on hover
-            );
-        int reply = msgBox.exec();
-
-        if (reply == QMessageBox::No) {
-            if (QFile::exists(filePath)) {
-                QFile::remove(filePath);
-            }
-            if (QFile::exists(file + ".meta")) {
-                QFile::remove(file + ".meta");
-            }
-        }
+    QString error;
+    QStringList resolved = m_manifest.resolve(selectedComponents(), error);
+    if (resolved.isEmpty()) {
+        QMessageBox::warning(this, "Input Error", error.isEmpty() ? "No components selected." : error);
+        return;
     }
 
-    auto controlFlags = new DownloadControlFlags();
-    if (m_controlFlags)
-        delete m_controlFlags;
-
-    m_controlFlags = new DownloadControlFlags();
-#ifdef Q_OS_WIN
-    url = "http://192.168.1.29/Data_WINDOWS.bin";
-#elif defined(Q_OS_LINUX)
-    url = "http://192.168.1.29/Data_LINUX.bin";
-#endif
-    manager = new DownloadManager(url, file, m_controlFlags);
-
-    workerThread = new QThread;
-
-    manager->moveToThread(workerThread);
-    connect(workerThread, &QThread::started, manager, &DownloadManager::start);
-    connect(workerThread, &QThread::finished, manager, &QObject::deleteLater);
-    connect(workerThread, &QThread::finished, workerThread, &QObject::deleteLater);
-    connect(manager, &DownloadManager::finished, this, [=]() {
-        ui->progressBarDownload->setValue(100);
-        ui->retryLabel->setText("");
-        ui->sizeLabel->setText("");
-        ui->etaLabel->setText("Download Complete.");
-        ui->speedLabel->setText("");
-        ui->startDownloadButton->setDisabled(true);
-        ui->resumeDownloadButton->setDisabled(true);
-        ui->cancelDownloadButton->setDisabled(true);
-        ui->nextButton->setDisabled(false);
-        workerThread->quit();
-        workerThread->wait();
-    });
-    connect(manager, &DownloadManager::error, this, [=](const QString &msg) {
-        if (m_controlFlags) {
-            delete m_controlFlags;
-            m_controlFlags = nullptr;
+    // Only fetch what is missing or changed since the last install
+    InstalledState installed = InstalledState::load(QDir(ui->txtInstallationPath->toPlainText()).absolutePath());
+    m_filter = selectedFilter();
+    m_plan.clear();
+    for (const QString &name : std::as_const(resolved)) {
+        if (installed.needsUpdate(*m_manifest.component(name), m_filter.key())) {
+            m_plan << name;
+        } else {
+            qDebug() << "Component" << name << "is up to date";
         }
-        workerThread->quit();
-        workerThread->wait();
-
-        manager = nullptr;
-        workerThread = nullptr;
-
-        QApplication::quit();
-    });
-
-    connect(manager, &DownloadManager::progress, this, [this](qint64 downloaded, qint64 total, double speed, int eta) {
-        int percent = (total > 0) ? static_cast<int>((downloaded * 100) / total) : 0;
-        ui->progressBarDownload->setValue(percent);
-        ui->sizeLabel->setText(QString("%1 / %2")
-                                   .arg(humanSize(downloaded))
-                                   .arg(humanSize(total)));
-        ui->speedLabel->setText(QString("Speed: %1 MB/s").arg(speed, 0, 'f', 2));
-        ui->etaLabel->setText(QString("ETA: %1 sec").arg(eta >= 0 ? eta : -1));
-    });
+    }
+    qDebug() << "Installing components:" << m_plan;
 
-    workerThread->start();
+    startInstallEngine();
 }
 
 QString MainWindow::humanSize(qint64 bytes) {
@@ -642,8 +1839,10 @@ void MainWindow::onLogMessage(const QString& msg) {
 }
 
 MainWindow::MainWindow(QWidget *parent)
-    : QMainWindow(parent), ui(new Ui::MainWindow) {
+    : QMainWindow(parent), ui(new Ui::MainWindow), m_engine(nullptr) {
     ui->setupUi(this);
+    // The log gets a line per file; older lines go first
+    ui->textEditInstallationLogs->document()->setMaximumBlockCount(MemoryBudget::instance().logLines());
 
     this->setWindowFlags(windowFlags() & ~Qt::WindowCloseButtonHint);
     this->setWindowFlags(windowFlags() & ~Qt::WindowMaximizeButtonHint);
@@ -651,10 +1850,6 @@ MainWindow::MainWindow(QWidget *parent)
 
     loadStyleSheet(":/themes/light.qss");
 
-    DownloadControlFlags *m_controlFlags = nullptr;
-    DownloadManager *manager = nullptr;
-    QThread *workerThread = nullptr;
-
     ui->tabWidget->tabBar()->hide();
     ui->progressBar->setRange(0, 100);
     ui->progressBarDownload->setRange(0, 100);
@@ -672,13 +1867,17 @@ MainWindow::MainWindow(QWidget *parent)
     connect(ui->cbShowInstallationDetails, &QCheckBox::clicked, this, [=]() {
         this->toggleInstallationDetails();
     });
+    connect(ui->listComponents, &QListWidget::itemChanged, this, &MainWindow::onComponentToggled);
+    connect(ui->comboProfile, &QComboBox::currentIndexChanged, this, &MainWindow::onProfileChanged);
+    connect(ui->tabWidget, &QTabWidget::currentChanged, this, [this](int index) {
+        if (Tracer::isEnabled())
+            Tracer::instance().instant("ui", "page " + ui->tabWidget->tabText(index));
+    });
 
     quitApp.store(true);
-    file = getExeFolder() + fileNameStr;
 
     isPaused = false;
     isPausedExtraction = false;
-    m_pauseExtraction.store(false);
 
     ui->startDownloadButton->hide();
 
@@ -689,11 +1888,15 @@ MainWindow::MainWindow(QWidget *parent)
     }
     qDebug() << "Installing to:" << installPath;
     ui->txtInstallationPath->setText(installPath);
+    probeStorage(installPath);
 
     init_ui_assets();
 
     ui->textEditInstallationLogs->setVisible(false);
     ui->imgScrutaNetInstall->setVisible(true);
+
+    // Once the event loop runs, so the command line options are in place
+    QTimer::singleShot(0, this, &MainWindow::loadManifest);
 }
 
 void MainWindow::init_ui_assets() {
@@ -786,22 +1989,23 @@ void MainWindow::init_ui_assets() {
 
 void MainWindow::onPauseClicked() {
     isPaused = !isPaused;
+    for (const Prefetch &prefetch : std::as_const(m_prefetches)) {
+        if (prefetch.adopted)
+            prefetch.token->setPaused(isPaused);
+    }
+    if (m_token)
+        m_token->setPaused(isPaused);
     if (isPaused) {
-        if (m_controlFlags)
-            m_controlFlags->paused.store(true);
         ui->resumeDownloadButton->setIcon(QIcon(":/icons/Blue-Button.png"));
         resumeDownloadButtonLabel->setText("Resume Download");
     } else {
-        if (m_controlFlags)
-            m_controlFlags->paused.store(false);
         ui->resumeDownloadButton->setIcon(QIcon(":/icons/Orange-Button.png"));
         resumeDownloadButtonLabel->setText("Pause Download");
     }
 }
 
 void MainWindow::onCancelClicked() {
-    if (m_controlFlags)
-        m_controlFlags->stopped.store(true);
+    cancelInstall();
 
     ui->cancelDownloadButton->setDisabled(true);
     ui->resumeDownloadButton->setText("Download Canceled");
@@ -811,7 +2015,7 @@ void MainWindow::onCancelClicked() {
     ui->speedLabel->clear();
     ui->progressBarDownload->setValue(0);
 
-    QApplication::quit();
+    quitWhenStopped();
 }
 
 void MainWindow::onBrowseClicked() {
@@ -822,13 +2026,54 @@ void MainWindow::onBrowseClicked() {
         QFileDialog::ShowDirsOnly | QFileDialog::DontResolveSymlinks
         );
 
+    if (dir.isEmpty()) {
+        return;
+    }
+
     dir = dir + QDir::separator() + "Plancksoft" + QDir::separator() + "ScrutaNet";
+    ui->txtInstallationPath->setText(dir);
+    probeStorage(dir);
+}
 
-    if (!dir.isEmpty()) {
-        ui->txtInstallationPath->setText(dir);
-    }
+// Measures the target storage in the background so the install can size its
+// download and extraction concurrency before it starts.
+void MainWindow::probeStorage(const QString &path) {
+    QString target = QDir(path).absolutePath();
+    auto *watcher = new QFutureWatcher<StorageProfile>(this);
+    connect(watcher, &QFutureWatcher<StorageProfile>::finished, this, [this, watcher]() {
+        StorageProfile profile = watcher->result();
+        watcher->deleteLater();
+        // Ignore results for a path the user has since moved away from
+        if (profile.path == QDir(ui->txtInstallationPath->toPlainText()).absolutePath())
+            applyStorageProfile(profile);
+    });
+    watcher->setFuture(QtConcurrent::run([target]() {
+        return StorageProbe::probe(target);
+    }));
+}
+
+void MainWindow::applyStorageProfile(const StorageProfile &profile) {
+    m_storageProfile = profile;
+    qDebug() << "Storage profile for" << profile.path << ":" << profile.summary();
+
+    m_installPool.setMaxThreadCount(downloadLimit() + profile.extractionWorkers + 2);
+    if (m_engine && m_engine->isRunning())
+        m_engine->setGroupLimit("extract:", profile.extractionWorkers);
 }
 
 MainWindow::~MainWindow() {
+    stopPrefetches();
+    m_prefetchPool.waitForDone();
+    bool unfinished = m_engine && m_engine->isRunning();
+    if (unfinished)
+        cancelInstall();
+    // The engine waits for its own tasks, which run on m_installPool
+    delete m_engine;
+    m_engine = nullptr;
+    // It had no chance to report, so clean up here; either way the cleanup
+    // has to be done before we exit
+    if (unfinished)
+        discardPartialInstall(true);
+    m_cleanup.waitForFinished();
     delete ui;
 }
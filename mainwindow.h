@@ -3,9 +3,20 @@
 
 #include <QMainWindow>
 #include <QProgressBar>
-#include <QFutureWatcher>
 #include <QCloseEvent>
+#include <QElapsedTimer>
+#include <QHash>
+#include <QThreadPool>
+#include <QFuture>
 #include "downloadmanager.h"
+#include "installengine.h"
+#include "manifest.h"
+#include "storageprobe.h"
+#include "stagedinstall.h"
+#include "payloadcache.h"
+#include "canceltoken.h"
+#include <vector>
+#include <istream>
 
 QT_BEGIN_NAMESPACE
 namespace Ui {
@@ -14,6 +25,30 @@ class MainWindow;
 QT_END_NAMESPACE
 
 class QThread;
+class QListWidgetItem;
+
+struct ArchiveIndex {
+    QList<ArchiveEntry> entries;    // everything selected in the archive
+    size_t items = 0;               // items in the archive, selected or not
+    std::vector<uint32_t> pending;  // indices still to extract
+    uint64_t size = 0;              // bytes in pending
+    uint64_t decoderMemory = 0;     // what the 7z decoder allocates, 0 if unknown
+    size_t files = 0;               // files in pending
+    // Entries left out of pending because pending has the same size and CRC
+    // under another path: (entry, path of the copy that is extracted)
+    QList<QPair<ArchiveEntry, QString>> duplicates;
+};
+
+// How archive entries with the same content as another are written
+enum class DedupMode { Off, Copy, Reflink, Hardlink };
+
+struct ComponentProgress {
+    qint64 downloaded = 0;
+    qint64 downloadTotal = 0;
+    double speed = 0;
+    uint64_t extracted = 0;
+    uint64_t extractTotal = 0;
+};
 
 class MainWindow : public QMainWindow
 {
@@ -23,6 +58,24 @@ public:
     MainWindow(QWidget *parent = nullptr);
     ~MainWindow();
 
+    // Removes the downloaded payloads once an install has been committed
+    void setDeletePayloads(bool enabled) { m_deletePayloads = enabled; }
+    // Manifest profile to preselect, plus extra patterns on top of it
+    void setSelection(const QString &profile, const QStringList &include, const QStringList &exclude);
+    // Clicks through a full install into installDir and exits with the UI
+    // latency report, see UiMonitor
+    void runBenchmark(const QString &installDir);
+    // With runBenchmark(): cancels the install afterMs into it and reports
+    // how long it took to stop instead
+    void setBenchmarkCancel(qint64 afterMs) { m_benchmarkCancelMs = afterMs; }
+    void setDedupMode(DedupMode mode) { m_dedup = mode; }
+    // Prefetches the launched program and its libraries before it starts
+    void setWarmStart(bool enabled) { m_warmStart = enabled; }
+    // Takes the manifest and payloads from a mirror URL or a local directory
+    // instead of the built-in server. Local payloads are extracted where they
+    // are unless copy is set.
+    void setSource(const QString &source, bool copy);
+
 private slots:
     void NextStep();
     void BackStep();
@@ -39,16 +92,96 @@ private slots:
     void init_ui_assets();
     void toggleTheme();
     void toggleInstallationDetails();
+    void onTaskStarted(const QString &id);
+    void onTaskFinished(const QString &id, qint64 elapsedMs);
+    void onTaskFailed(const QString &id, const QString &msg);
+    void onComponentToggled(QListWidgetItem *item);
+    void onProfileChanged(int index);
 
 private:
     Ui::MainWindow *ui;
     QString humanSize(qint64 bytes);
-    void extractResourceArchive(const QString& resourcePath, const QString& outputDir, const QString& password = QString());
-    QFutureWatcher<void> m_extractionWatcher;
-    DownloadManager *manager;
-    QThread *workerThread;
+    void startInstallEngine();
+    bool downloadsOutstanding() const;
+    void showInstallationPage();
+    QString payloadPath(const Component& component);
+    bool extractsInPlace(const Component& component) const;
+    bool prepareArchive(const Component& component, QString &error);
+    // Lists the archive at archivePath, or read from stream when given;
+    // archivePath then only names it
+    bool scanArchive(const QString& archivePath, const QString& password, const EntryFilter& filter,
+                     ArchiveIndex &index, QString &error, std::istream *stream = nullptr);
+    bool preflightArchive(const Component& component, const QString& password, const EntryFilter& filter,
+                          ArchiveIndex &index, QString &error, const CancelToken *token);
+    bool carryOverUnchanged(const QString& name, const StagedInstall& staged, const InstalledState& installed,
+                            ArchiveIndex &index, QString &error);
+    bool extractResourceArchive(const QString& name, const QString& archivePath, const QString& outputDir,
+                                const QString& password, const ArchiveIndex &index, QString &error);
+    void planDuplicates(const QString& name, DedupMode mode, ArchiveIndex &index);
+    bool materializeDuplicates(const QString& archivePath, const QString& password, const QString& outputDir,
+                               const ArchiveIndex &index, DedupMode mode, QString &error);
+    bool fixPermissions(const QString& installDir, QString &error);
+    bool launchInstalledApp(const QString& installDir, QString &error);
+    void warmLaunchFiles(const QString& installDir);
+    void onDownloadProgress(const QString &name, qint64 downloaded, qint64 total, double speed);
+    void onExtractionProgress(const QString &name, uint64_t processed, uint64_t total);
+    void loadManifest();
+    void populateComponents();
+    QStringList selectedComponents() const;
+    EntryFilter selectedFilter() const;
+    void probeStorage(const QString &path);
+    void applyStorageProfile(const StorageProfile &profile);
+    void finishBenchmark(bool success);
+    void finishCancelBenchmark();
+    // Stops every worker of the running install; cleanup follows once the engine is done
+    void cancelInstall();
+    // Removes the staging dir and the extracted codec of an install that did not commit
+    void discardPartialInstall(bool wait);
+    void quitWhenStopped();
+    void startPrefetch();
+    void adoptPrefetches();
+    void stopPrefetches();
+    InstallEngine *m_engine;
+    Manifest m_manifest;
+    PayloadCache m_cache;
+    bool m_manifestReady = false;
+    bool m_deletePayloads = false;
+    bool m_warmStart = true;
+    bool m_benchmark = false;
+    qint64 m_benchmarkCancelMs = 0;
+    QElapsedTimer m_cancelTimer;
+    DedupMode m_dedup = DedupMode::Reflink;
+    QString m_source;
+    bool m_copySource = false;
+    QString m_requestedProfile;
+    QStringList m_extraInclude;
+    QStringList m_extraExclude;
+    EntryFilter m_filter;
+    QStringList m_plan;
+    QHash<QString, DownloadManager*> m_downloads;
+    // Pause and cancel of the running install, new for each one
+    std::shared_ptr<CancelToken> m_token;
+    std::shared_ptr<StagedInstall> m_staged;
+    QFuture<void> m_cleanup;
+
+    // Downloads started before the user asked for them, see startPrefetch()
+    struct Prefetch {
+        DownloadManager *download = nullptr;
+        std::shared_ptr<CancelToken> token;
+        QString component;
+        bool adopted = false;
+        // Set on adoption; the download thread then raises its priority
+        std::shared_ptr<std::atomic<bool>> fullSpeed;
+    };
+    QHash<QString, Prefetch> m_prefetches;
+    QThreadPool m_prefetchPool;
+    QHash<QString, ComponentProgress> m_progress;
+    QElapsedTimer m_extractTimer;
+    StorageProfile m_storageProfile;
+    QThreadPool m_installPool;
     bool isPaused;
     bool isPausedExtraction;
     QString getExeFolder();
+    bool registerPayloadResource();
 };
 #endif // MAINWINDOW_H
@@ -0,0 +1,437 @@
+#include "manifest.h"
+#include "pagecache.h"
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QJsonArray>
+#include <QFile>
+#include <QFileInfo>
+#include <QUrl>
+#include <QSaveFile>
+#include <QCryptographicHash>
+#include <QSet>
+#include <functional>
+
+static const char *installedStateFile = "/.scrutanet-installed.json";
+
+bool Manifest::fromJson(const QByteArray &json, Manifest &manifest, QString &error) {
+    QJsonParseError parseError;
+    QJsonDocument doc = QJsonDocument::fromJson(json, &parseError);
+    if (doc.isNull() || !doc.isObject()) {
+        error = "Invalid manifest: " + parseError.errorString();
+        return false;
+    }
+
+    QJsonObject root = doc.object();
+    manifest.version = root.value("version").toString();
+    manifest.components.clear();
+
+    QSet<QString> names;
+    for (const QJsonValue &value : root.value("components").toArray()) {
+        QJsonObject obj = value.toObject();
+        Component c;
+        c.name = obj.value("name").toString();
+        c.title = obj.value("title").toString(c.name);
+        c.version = obj.value("version").toString(manifest.version);
+        c.url = obj.value("url").toString();
+        c.fileName = obj.value("file").toString(QUrl(c.url).fileName());
+        c.sha256 = obj.value("sha256").toString().toLower();
+        c.password = obj.value("password").toString();
+        c.size = obj.value("size").toVariant().toLongLong();
+        c.required = obj.value("required").toBool(false);
+        c.selectedByDefault = obj.value("default").toBool(true);
+        for (const QJsonValue &dep : obj.value("dependencies").toArray())
+            c.dependencies << dep.toString();
+
+        qint64 volumesSize = 0;
+        for (const QJsonValue &value : obj.value("volumes").toArray()) {
+            QJsonObject volumeObj = value.toObject();
+            Volume volume;
+            volume.url = volumeObj.value("url").toString();
+            volume.fileName = volumeObj.value("file").toString(QUrl(volume.url).fileName());
+            volume.sha256 = volumeObj.value("sha256").toString().toLower();
+            volume.size = volumeObj.value("size").toVariant().toLongLong();
+            if (volume.url.isEmpty() || volume.fileName.isEmpty()) {
+                error = "Invalid manifest: volume without url in " + c.name;
+                return false;
+            }
+            volumesSize += volume.size;
+            c.volumes.append(volume);
+        }
+        if (!c.volumes.isEmpty() && c.size <= 0)
+            c.size = volumesSize;
+
+        if (c.name.isEmpty() || (c.volumes.isEmpty() && (c.url.isEmpty() || c.fileName.isEmpty()))) {
+            error = "Invalid manifest: component without name or url";
+            return false;
+        }
+        if (names.contains(c.name)) {
+            error = "Invalid manifest: duplicate component " + c.name;
+            return false;
+        }
+        names.insert(c.name);
+        manifest.components.append(c);
+    }
+
+    for (const QJsonValue &value : root.value("profiles").toArray()) {
+        QJsonObject obj = value.toObject();
+        Profile p;
+        p.name = obj.value("name").toString();
+        p.title = obj.value("title").toString(p.name);
+        for (const QJsonValue &name : obj.value("components").toArray())
+            p.components << name.toString();
+        for (const QJsonValue &pattern : obj.value("include").toArray())
+            p.include << pattern.toString();
+        for (const QJsonValue &pattern : obj.value("exclude").toArray())
+            p.exclude << pattern.toString();
+        if (p.name.isEmpty()) {
+            error = "Invalid manifest: profile without name";
+            return false;
+        }
+        manifest.profiles.append(p);
+    }
+
+    if (manifest.components.isEmpty()) {
+        error = "Invalid manifest: no components";
+        return false;
+    }
+    for (const Component &c : std::as_const(manifest.components)) {
+        for (const QString &dep : c.dependencies) {
+            if (!names.contains(dep)) {
+                error = QString("Invalid manifest: %1 depends on unknown component %2").arg(c.name, dep);
+                return false;
+            }
+        }
+    }
+    for (const Profile &p : std::as_const(manifest.profiles)) {
+        for (const QString &name : p.components) {
+            if (!names.contains(name)) {
+                error = QString("Invalid manifest: profile %1 selects unknown component %2").arg(p.name, name);
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+Manifest Manifest::singlePayload(const QString &url, const QString &fileName, const QString &resource) {
+    Component c;
+    c.name = "ScrutaNet";
+    c.title = "ScrutaNet";
+    c.url = url;
+    c.fileName = fileName;
+    c.resource = resource;
+    c.required = true;
+
+    Manifest manifest;
+    manifest.components.append(c);
+    return manifest;
+}
+
+QByteArray Manifest::toJson() const {
+    QJsonArray components;
+    for (const Component &c : this->components) {
+        QJsonObject obj;
+        obj["name"] = c.name;
+        obj["title"] = c.title;
+        obj["version"] = c.version;
+        if (!c.url.isEmpty())
+            obj["url"] = c.url;
+        if (c.fileName != QUrl(c.url).fileName())
+            obj["file"] = c.fileName;
+        if (!c.sha256.isEmpty())
+            obj["sha256"] = c.sha256;
+        if (c.size > 0)
+            obj["size"] = c.size;
+        if (c.required)
+            obj["required"] = true;
+        if (!c.selectedByDefault)
+            obj["default"] = false;
+        if (!c.dependencies.isEmpty())
+            obj["dependencies"] = QJsonArray::fromStringList(c.dependencies);
+        if (!c.volumes.isEmpty()) {
+            QJsonArray volumes;
+            for (const Volume &volume : c.volumes) {
+                QJsonObject volumeObj;
+                volumeObj["url"] = volume.url;
+                if (volume.fileName != QUrl(volume.url).fileName())
+                    volumeObj["file"] = volume.fileName;
+                if (!volume.sha256.isEmpty())
+                    volumeObj["sha256"] = volume.sha256;
+                if (volume.size > 0)
+                    volumeObj["size"] = volume.size;
+                volumes.append(volumeObj);
+            }
+            obj["volumes"] = volumes;
+        }
+        components.append(obj);
+    }
+
+    QJsonArray profiles;
+    for (const Profile &p : this->profiles) {
+        QJsonObject obj;
+        obj["name"] = p.name;
+        obj["title"] = p.title;
+        if (!p.components.isEmpty())
+            obj["components"] = QJsonArray::fromStringList(p.components);
+        if (!p.include.isEmpty())
+            obj["include"] = QJsonArray::fromStringList(p.include);
+        if (!p.exclude.isEmpty())
+            obj["exclude"] = QJsonArray::fromStringList(p.exclude);
+        profiles.append(obj);
+    }
+
+    QJsonObject root;
+    root["version"] = version;
+    root["components"] = components;
+    if (!profiles.isEmpty())
+        root["profiles"] = profiles;
+    return QJsonDocument(root).toJson();
+}
+
+void Manifest::rebase(const QString &base) {
+    for (Component &c : components) {
+        if (!c.url.isEmpty())
+            c.url = base + "/" + c.fileName;
+        for (Volume &volume : c.volumes)
+            volume.url = base + "/" + volume.fileName;
+    }
+}
+
+QList<Component> Component::payloads() const {
+    if (volumes.isEmpty())
+        return {*this};
+
+    QList<Component> parts;
+    for (int i = 0; i < volumes.size(); ++i) {
+        Component part = *this;
+        part.name = QString("%1.%2").arg(name).arg(i + 1, 3, 10, QLatin1Char('0'));
+        part.url = volumes[i].url;
+        part.fileName = volumes[i].fileName;
+        part.sha256 = volumes[i].sha256;
+        part.size = volumes[i].size;
+        part.resource.clear();
+        part.volumes.clear();
+        parts.append(part);
+    }
+    return parts;
+}
+
+const Component *Manifest::component(const QString &name) const {
+    for (const Component &c : components) {
+        if (c.name == name)
+            return &c;
+    }
+    return nullptr;
+}
+
+const Profile *Manifest::profile(const QString &name) const {
+    for (const Profile &p : profiles) {
+        if (p.name == name)
+            return &p;
+    }
+    return nullptr;
+}
+
+QStringList Manifest::resolve(const QStringList &selection, QString &error) const {
+    QStringList ordered;
+    QSet<QString> visiting;
+
+    // Depth-first, so every component comes after the ones it depends on
+    std::function<bool(const QString &)> visit = [&](const QString &name) {
+        if (ordered.contains(name))
+            return true;
+        if (visiting.contains(name)) {
+            error = "Component dependency cycle at " + name;
+            return false;
+        }
+        const Component *c = component(name);
+        if (!c) {
+            error = "Unknown component " + name;
+            return false;
+        }
+        visiting.insert(name);
+        for (const QString &dep : c->dependencies) {
+            if (!visit(dep))
+                return false;
+        }
+        visiting.remove(name);
+        ordered.append(name);
+        return true;
+    };
+
+    for (const Component &c : components) {
+        if (c.required && !visit(c.name))
+            return {};
+    }
+    for (const QString &name : selection) {
+        if (!visit(name))
+            return {};
+    }
+    return ordered;
+}
+
+InstalledState InstalledState::load(const QString &installDir) {
+    InstalledState state;
+    QFile file(installDir + installedStateFile);
+    if (!file.open(QIODevice::ReadOnly))
+        return state;
+
+    QJsonObject components = QJsonDocument::fromJson(file.readAll()).object().value("components").toObject();
+    for (auto it = components.begin(); it != components.end(); ++it) {
+        QJsonObject obj = it.value().toObject();
+        state.m_entries.insert(it.key(), {obj.value("version").toString(), obj.value("sha256").toString(),
+                                          obj.value("selection").toString()});
+
+        // "files": { "bin/app": [size, crc], ... }
+        QJsonObject files = obj.value("files").toObject();
+        for (auto f = files.begin(); f != files.end(); ++f) {
+            QJsonArray sizeAndCrc = f.value().toArray();
+            File record;
+            record.component = it.key();
+            record.size = sizeAndCrc.at(0).toVariant().toULongLong();
+            record.crc = sizeAndCrc.at(1).toVariant().toUInt();
+            state.m_files.insert(f.key(), record);
+        }
+    }
+    return state;
+}
+
+bool InstalledState::save(const QString &installDir) const {
+    QHash<QString, QJsonObject> files;
+    for (auto it = m_files.begin(); it != m_files.end(); ++it)
+        files[it->component][it.key()] = QJsonArray{static_cast<qint64>(it->size), static_cast<qint64>(it->crc)};
+
+    QJsonObject components;
+    for (auto it = m_entries.begin(); it != m_entries.end(); ++it) {
+        QJsonObject obj;
+        obj["version"] = it->version;
+        obj["sha256"] = it->sha256;
+        if (!it->selection.isEmpty())
+            obj["selection"] = it->selection;
+        if (files.contains(it.key()))
+            obj["files"] = files.value(it.key());
+        components[it.key()] = obj;
+    }
+    QJsonObject root;
+    root["components"] = components;
+
+    QSaveFile file(installDir + installedStateFile);
+    if (!file.open(QIODevice::WriteOnly))
+        return false;
+    file.write(QJsonDocument(root).toJson());
+    return file.commit();
+}
+
+bool InstalledState::needsUpdate(const Component &component, const QString &selection) const {
+    auto it = m_entries.constFind(component.name);
+    if (it == m_entries.constEnd() || it->selection != selection)
+        return true;
+    // Without version or hash there is nothing to compare, so always refresh
+    if (component.version.isEmpty() && component.sha256.isEmpty())
+        return true;
+    return it->version != component.version || it->sha256 != component.sha256;
+}
+
+void InstalledState::record(const Component &component, const QString &selection) {
+    m_entries.insert(component.name, {component.version, component.sha256, selection});
+}
+
+void InstalledState::recordFiles(const QString &component, const QList<ArchiveEntry> &entries) {
+    m_files.removeIf([&](QHash<QString, File>::iterator it) {
+        return it->component == component;
+    });
+    for (const ArchiveEntry &entry : entries) {
+        if (!entry.isDir)
+            m_files.insert(entry.path, {component, entry.size, entry.crc});
+    }
+}
+
+const InstalledState::File *InstalledState::file(const QString &path) const {
+    auto it = m_files.constFind(path);
+    return it == m_files.constEnd() ? nullptr : &it.value();
+}
+
+EntryFilter::EntryFilter(const QStringList &include, const QStringList &exclude)
+    : m_include(include), m_exclude(exclude), m_includeRx(compile(include)), m_excludeRx(compile(exclude)) {
+}
+
+QList<EntryFilter::Pattern> EntryFilter::compile(const QStringList &patterns) {
+    QList<Pattern> compiled;
+    for (const QString &pattern : patterns)
+        compiled.append({QRegularExpression(QRegularExpression::wildcardToRegularExpression(pattern)), !pattern.contains('/')});
+    return compiled;
+}
+
+bool EntryFilter::matchesAny(const QList<Pattern> &patterns, const QString &path) {
+    // The path itself, then every directory above it
+    QString prefix = path;
+    while (!prefix.isEmpty()) {
+        QString name = prefix.mid(prefix.lastIndexOf('/') + 1);
+        for (const Pattern &pattern : patterns) {
+            if (pattern.rx.match(pattern.anyDepth ? name : prefix).hasMatch())
+                return true;
+        }
+        prefix.truncate(qMax(0, prefix.lastIndexOf('/')));
+    }
+    return false;
+}
+
+bool EntryFilter::matches(const QString &path) const {
+    if (isEmpty())
+        return true;
+    if (!m_includeRx.isEmpty() && !matchesAny(m_includeRx, path))
+        return false;
+    return !matchesAny(m_excludeRx, path);
+}
+
+QString EntryFilter::key() const {
+    if (isEmpty())
+        return QString();
+    return "include:" + m_include.join(',') + ";exclude:" + m_exclude.join(',');
+}
+
+bool verifyComponentFile(const Component &component, const QString &path, QString &error,
+                         const std::function<bool()> &canceled) {
+    QFileInfo fi(path);
+    if (!fi.exists()) {
+        error = "Installation data not found: " + path;
+        return false;
+    }
+    if (component.size > 0 && fi.size() != component.size) {
+        error = QString("%1: size mismatch (%2 of %3 bytes)").arg(component.name).arg(fi.size()).arg(component.size);
+        return false;
+    }
+    if (component.sha256.isEmpty())
+        return true;
+
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly)) {
+        error = "Cannot open " + path;
+        return false;
+    }
+    // Extraction reads the payload again right after; keep it from filling
+    // the page cache twice
+    ReadAhead hints(path);
+    QCryptographicHash hash(QCryptographicHash::Sha256);
+    QByteArray chunk(4 * 1024 * 1024, Qt::Uninitialized);
+    qint64 offset = 0;
+    while (!file.atEnd()) {
+        if (canceled && canceled()) {
+            error = "Verification of " + component.name + " canceled";
+            return false;
+        }
+        qint64 n = file.read(chunk.data(), chunk.size());
+        if (n < 0) {
+            error = "Cannot read " + path;
+            return false;
+        }
+        hash.addData(QByteArrayView(chunk.constData(), n));
+        offset += n;
+        hints.advance(offset);
+    }
+    if (hash.result().toHex() != component.sha256.toLatin1()) {
+        error = component.name + ": checksum mismatch";
+        return false;
+    }
+    return true;
+}
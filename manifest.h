@@ -0,0 +1,165 @@
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include <QString>
+#include <QStringList>
+#include <QList>
+#include <QHash>
+#include <QByteArray>
+#include <QRegularExpression>
+#include <functional>
+
+// One archive of a payload that is split into several. Every volume is a
+// complete 7z archive of its own, like the blocks payload-packer writes.
+struct Volume {
+    QString url;
+    QString fileName;
+    QString sha256;
+    qint64 size = 0;
+};
+
+// One independently downloadable and extractable part of the product
+struct Component {
+    QString name;
+    QString title;
+    QString version;
+    QString url;
+    QString fileName;           // local file name, defaults to the URL's
+    QString sha256;             // hex, optional
+    QString password;           // archive password, empty for the default
+    QString resource;           // bundled fallback payload, optional
+    qint64 size = 0;            // payload size in bytes, 0 if unknown
+    QStringList dependencies;
+    QList<Volume> volumes;      // replaces url, sha256 and size when set
+    bool required = false;
+    bool selectedByDefault = true;
+
+    // What has to be downloaded and extracted: the component itself, or one
+    // entry per volume named <name>.001, <name>.002, ...
+    QList<Component> payloads() const;
+};
+
+// One item of a payload archive, as listed by bit7z
+struct ArchiveEntry {
+    uint32_t index = 0;
+    QString path;               // relative, '/' separated
+    quint64 size = 0;
+    quint32 crc = 0;
+    bool isDir = false;
+};
+
+// A named selection offered by the manifest, e.g. a minimal server install
+// without the GUI, docs and samples
+struct Profile {
+    QString name;
+    QString title;
+    QStringList components;     // components to select, empty to keep the selection
+    QStringList include;        // archive paths to extract, empty for all
+    QStringList exclude;        // archive paths to leave out
+};
+
+// Picks the archive entries to extract by glob pattern. A pattern without
+// a '/' is matched against every name in the path, so "*.pdb" matches
+// them at any depth and "docs" every directory called docs; one with a '/'
+// against the path from the top. A pattern that matches a directory also
+// matches everything below it, so "docs" and "docs/*" both leave out all
+// of docs.
+class EntryFilter {
+public:
+    EntryFilter() = default;
+    EntryFilter(const QStringList &include, const QStringList &exclude);
+
+    bool isEmpty() const { return m_include.isEmpty() && m_exclude.isEmpty(); }
+    bool matches(const QString &path) const;
+    // Stored with each installed component; a different key means reinstall
+    QString key() const;
+
+private:
+    struct Pattern {
+        QRegularExpression rx;
+        bool anyDepth = false;      // no '/', matched against each name
+    };
+    static QList<Pattern> compile(const QStringList &patterns);
+    static bool matchesAny(const QList<Pattern> &patterns, const QString &path);
+
+    QStringList m_include;
+    QStringList m_exclude;
+    QList<Pattern> m_includeRx;
+    QList<Pattern> m_excludeRx;
+};
+
+// Describes everything the installer can fetch. Published next to the
+// payloads as JSON:
+//
+//   { "version": "1.4.0",
+//     "components": [
+//       { "name": "server", "title": "ScrutaNet Server", "version": "1.4.0",
+//         "url": "http://host/server_LINUX.bin", "size": 123, "sha256": "...",
+//         "required": true },
+//       { "name": "gui", "url": "...", "dependencies": ["server"] },
+//       { "name": "data", "volumes": [
+//         { "url": "http://host/data-001.7z", "size": 123, "sha256": "..." },
+//         { "url": "http://host/data-002.7z", "size": 456, "sha256": "..." } ] } ],
+//     "profiles": [
+//       { "name": "minimal-server", "title": "Minimal server", "components": ["server"],
+//         "exclude": ["docs", "samples", "*.pdb"] } ] }
+class Manifest {
+public:
+    static bool fromJson(const QByteArray &json, Manifest &manifest, QString &error);
+    // Single-component manifest for servers that only publish one payload
+    static Manifest singlePayload(const QString &url, const QString &fileName, const QString &resource);
+
+    QByteArray toJson() const;
+    // Points every payload at <base>/<file name>, for installing from a
+    // mirror or local media with the manifest published for the server
+    void rebase(const QString &base);
+
+    const Component *component(const QString &name) const;
+    const Profile *profile(const QString &name) const;
+    // Expands a selection with everything it depends on, dependencies first
+    QStringList resolve(const QStringList &selection, QString &error) const;
+
+    QString version;
+    QList<Component> components;
+    QList<Profile> profiles;
+};
+
+// What is already on disk, stored in the installation directory
+class InstalledState {
+public:
+    static InstalledState load(const QString &installDir);
+    bool save(const QString &installDir) const;
+
+    // True when the component is missing or differs from what is installed,
+    // including which of its files were selected
+    bool needsUpdate(const Component &component, const QString &selection = QString()) const;
+    void record(const Component &component, const QString &selection = QString());
+    // Replaces the file list of a component, used to find unchanged files on upgrade
+    void recordFiles(const QString &component, const QList<ArchiveEntry> &entries);
+
+    struct File {
+        QString component;
+        quint64 size = 0;
+        quint32 crc = 0;
+    };
+    // Installed file at a relative path, or nullptr if no component owns it
+    const File *file(const QString &path) const;
+    // Relative paths of every installed file
+    QStringList files() const { return m_files.keys(); }
+
+private:
+    struct Entry {
+        QString version;
+        QString sha256;
+        QString selection;      // EntryFilter::key() of the install
+    };
+    QHash<QString, Entry> m_entries;
+    QHash<QString, File> m_files;
+};
+
+// Checks size and SHA-256 of a downloaded payload against the manifest.
+// Hashing stops early, with an error, once canceled() returns true.
+bool verifyComponentFile(const Component &component, const QString &path, QString &error,
+                         const std::function<bool()> &canceled = {});
+
+#endif // MANIFEST_H
@@ -0,0 +1,70 @@
+#include "memorybudget.h"
+#include "canceltoken.h"
+#include <QFile>
+#include <QDebug>
+#include <chrono>
+
+// Buffers for one stream get at most this share of the budget
+static const qint64 bufferShare = 256;
+static const qint64 minBufferSize = 16 * 1024;
+
+MemoryBudget &MemoryBudget::instance() {
+    static MemoryBudget budget;
+    return budget;
+}
+
+void MemoryBudget::setLimit(qint64 bytes) {
+    m_limit.store(qMax<qint64>(0, bytes));
+    if (bytes > 0)
+        qDebug() << "Memory budget:" << bytes / (1024 * 1024) << "MiB";
+}
+
+qint64 MemoryBudget::containerLimit() {
+#ifdef Q_OS_LINUX
+    // cgroup v2, then v1; v1 reports "unlimited" as a huge number
+    for (const char *path : {"/sys/fs/cgroup/memory.max", "/sys/fs/cgroup/memory/memory.limit_in_bytes"}) {
+        QFile file(path);
+        if (!file.open(QIODevice::ReadOnly))
+            continue;
+        bool ok = false;
+        qint64 limit = file.readAll().trimmed().toLongLong(&ok);
+        return ok && limit < (qint64(1) << 60) ? limit : 0;
+    }
+#endif
+    return 0;
+}
+
+bool MemoryBudget::acquire(qint64 bytes, const CancelToken &token) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    qint64 budget = limit();
+    if (budget > 0 && bytes > budget)
+        qWarning() << "Memory budget: needs" << bytes / (1024 * 1024) << "MiB, more than the whole budget; running alone";
+    // Short waits so a cancel is noticed within CancelToken::boundMs
+    while (budget > 0 && m_reserved > 0 && m_reserved + bytes > budget) {
+        if (token.isCanceled())
+            return false;
+        m_released.wait_for(lock, std::chrono::milliseconds(100));
+        budget = limit();
+    }
+    m_reserved += bytes;
+    return true;
+}
+
+void MemoryBudget::release(qint64 bytes) {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_reserved -= bytes;
+    }
+    m_released.notify_all();
+}
+
+qint64 MemoryBudget::bufferSize(qint64 want) const {
+    qint64 budget = limit();
+    if (budget <= 0)
+        return want;
+    return qMin(want, qMax(minBufferSize, budget / bufferShare));
+}
+
+int MemoryBudget::logLines() const {
+    return isLimited() ? 1000 : 10000;
+}
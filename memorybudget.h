@@ -0,0 +1,47 @@
+#ifndef MEMORYBUDGET_H
+#define MEMORYBUDGET_H
+
+#include <QtGlobal>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+
+class CancelToken;
+
+// Keeps an install inside a memory limit, for small VMs and containers.
+// Extractions reserve what their decoder allocates (mostly the archive's
+// dictionary) and wait while others hold the rest; buffers and the log
+// shrink. Set with --memory-budget; inside a memory-limited cgroup half
+// of the limit is used by default.
+class MemoryBudget {
+public:
+    static MemoryBudget &instance();
+
+    // 0 for no limit
+    void setLimit(qint64 bytes);
+    qint64 limit() const { return m_limit.load(std::memory_order_relaxed); }
+    bool isLimited() const { return limit() > 0; }
+    // Memory limit of the cgroup we run in, 0 if there is none
+    static qint64 containerLimit();
+
+    // Waits until bytes fit next to the other reservations. A reservation
+    // larger than the whole budget still gets its turn, alone. False if
+    // canceled while waiting.
+    bool acquire(qint64 bytes, const CancelToken &token);
+    void release(qint64 bytes);
+
+    // want, or less so that buffers stay a small share of the budget
+    qint64 bufferSize(qint64 want) const;
+    // Lines the installation log keeps
+    int logLines() const;
+
+private:
+    MemoryBudget() = default;
+
+    std::atomic<qint64> m_limit{0};
+    std::mutex m_mutex;
+    std::condition_variable m_released;
+    qint64 m_reserved = 0;
+};
+
+#endif // MEMORYBUDGET_H
@@ -0,0 +1,249 @@
+#include "pagecache.h"
+#include <QFile>
+#include <QDebug>
+#include <cstdlib>
+#include <cstring>
+
+#ifdef Q_OS_LINUX
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <vector>
+#endif
+
+static const qint64 directAlignment = 4096;
+static const qint64 directBufferSize = 4 * 1024 * 1024;
+
+WriteBehind::WriteBehind(int fd, qint64 offset, qint64 window)
+    : m_fd(fd), m_window(window),
+      m_started(offset - offset % window), m_dropped(offset - offset % window) {
+}
+
+void WriteBehind::advance(qint64 offset) {
+#ifdef Q_OS_LINUX
+    while (offset - m_started >= m_window) {
+        // Start writeback of this window without waiting for it
+        sync_file_range(m_fd, m_started, m_window, SYNC_FILE_RANGE_WRITE);
+        m_started += m_window;
+
+        // The one before had a whole window's time to finish; drop it
+        if (m_started - m_dropped > m_window) {
+            sync_file_range(m_fd, m_dropped, m_window,
+                            SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+            posix_fadvise(m_fd, m_dropped, m_window, POSIX_FADV_DONTNEED);
+            m_dropped += m_window;
+        }
+    }
+#else
+    Q_UNUSED(offset);
+#endif
+}
+
+void WriteBehind::finish() {
+#ifdef Q_OS_LINUX
+    fdatasync(m_fd);
+    posix_fadvise(m_fd, m_dropped, 0, POSIX_FADV_DONTNEED);
+#endif
+}
+
+ReadAhead::ReadAhead(const QString &path, qint64 window)
+    : m_window(window) {
+#ifdef Q_OS_LINUX
+    m_fd = ::open(QFile::encodeName(path).constData(), O_RDONLY | O_CLOEXEC);
+    if (m_fd < 0)
+        return;
+    struct stat st;
+    if (fstat(m_fd, &st) == 0)
+        m_size = st.st_size;
+    posix_fadvise(m_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    advance(0);
+#else
+    Q_UNUSED(path);
+#endif
+}
+
+ReadAhead::~ReadAhead() {
+#ifdef Q_OS_LINUX
+    if (m_fd >= 0) {
+        posix_fadvise(m_fd, 0, 0, POSIX_FADV_DONTNEED);
+        ::close(m_fd);
+    }
+#endif
+}
+
+void ReadAhead::advance(qint64 offset) {
+#ifdef Q_OS_LINUX
+    if (m_fd < 0)
+        return;
+    // Keep a window queued ahead of the reader, in half-window steps
+    if (offset + m_window / 2 >= m_ahead && m_ahead < m_size) {
+        qint64 from = qMax(offset, m_ahead);
+        posix_fadvise(m_fd, from, offset + m_window - from, POSIX_FADV_WILLNEED);
+        m_ahead = offset + m_window;
+    }
+    // Drop what is a full window behind; the reader position is an estimate
+    qint64 behind = offset - m_window;
+    if (behind - m_dropped >= m_window) {
+        posix_fadvise(m_fd, m_dropped, behind - m_dropped, POSIX_FADV_DONTNEED);
+        m_dropped = behind;
+    }
+#else
+    Q_UNUSED(offset);
+#endif
+}
+
+void ReadAhead::drop(const QString &path) {
+#ifdef Q_OS_LINUX
+    int fd = ::open(QFile::encodeName(path).constData(), O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        ::close(fd);
+    }
+#else
+    Q_UNUSED(path);
+#endif
+}
+
+void ReadAhead::willNeed(const QString &path) {
+#ifdef Q_OS_LINUX
+    int fd = ::open(QFile::encodeName(path).constData(), O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+        ::close(fd);
+    }
+#else
+    Q_UNUSED(path);
+#endif
+}
+
+qint64 ReadAhead::cachedBytes(const QString &path) {
+#ifdef Q_OS_LINUX
+    int fd = ::open(QFile::encodeName(path).constData(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    struct stat st;
+    bool known = fstat(fd, &st) == 0;
+    qint64 cached = known && st.st_size == 0 ? 0 : -1;
+    // Mapping does not read anything; mincore only looks
+    void *map = known && st.st_size > 0 ? mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    if (map != MAP_FAILED) {
+        long page = sysconf(_SC_PAGESIZE);
+        std::vector<unsigned char> resident((st.st_size + page - 1) / page);
+        if (mincore(map, st.st_size, resident.data()) == 0) {
+            cached = 0;
+            for (unsigned char pageState : resident)
+                cached += (pageState & 1) ? page : 0;
+            cached = qMin<qint64>(cached, st.st_size);
+        }
+        munmap(map, st.st_size);
+    }
+    ::close(fd);
+    return cached;
+#else
+    Q_UNUSED(path);
+    return -1;
+#endif
+}
+
+#ifdef Q_OS_LINUX
+static bool writeAll(int fd, const char *data, qint64 size, qint64 offset) {
+    while (size > 0) {
+        ssize_t n = pwrite(fd, data, static_cast<size_t>(size), offset);
+        if (n <= 0)
+            return false;
+        data += n;
+        size -= n;
+        offset += n;
+    }
+    return true;
+}
+#endif
+
+DirectFileWriter::~DirectFileWriter() {
+    close();
+}
+
+bool DirectFileWriter::open(const QString &path, qint64 offset) {
+#if defined(Q_OS_LINUX) && defined(O_DIRECT)
+    QByteArray name = QFile::encodeName(path);
+    m_directFd = ::open(name.constData(), O_WRONLY | O_CREAT | O_DIRECT | O_CLOEXEC, 0644);
+    if (m_directFd < 0)
+        return false;   // e.g. tmpfs
+    m_fd = ::open(name.constData(), O_WRONLY | O_CLOEXEC);
+    void *buffer = nullptr;
+    if (m_fd < 0 || ftruncate(m_fd, offset) != 0
+        || posix_memalign(&buffer, directAlignment, directBufferSize) != 0) {
+        close();
+        return false;
+    }
+    m_buffer = static_cast<char *>(buffer);
+    m_used = 0;
+    m_offset = offset;
+    return true;
+#else
+    Q_UNUSED(path);
+    Q_UNUSED(offset);
+    return false;
+#endif
+}
+
+bool DirectFileWriter::write(const char *data, qint64 size) {
+    while (size > 0) {
+        qint64 n = qMin(size, directBufferSize - m_used);
+        memcpy(m_buffer + m_used, data, static_cast<size_t>(n));
+        m_used += n;
+        data += n;
+        size -= n;
+        if (m_used == directBufferSize && !flush(false))
+            return false;
+    }
+    return true;
+}
+
+bool DirectFileWriter::flush(bool final) {
+#ifdef Q_OS_LINUX
+    // O_DIRECT needs aligned offsets, lengths and memory: a resumed download
+    // first writes up to the next boundary the normal way
+    qint64 head = qMin(m_used, (directAlignment - m_offset % directAlignment) % directAlignment);
+    if (head > 0) {
+        if (!writeAll(m_fd, m_buffer, head, m_offset))
+            return false;
+        memmove(m_buffer, m_buffer + head, static_cast<size_t>(m_used - head));
+        m_used -= head;
+        m_offset += head;
+    }
+
+    qint64 aligned = (m_used / directAlignment) * directAlignment;
+    if (aligned > 0 && !writeAll(m_directFd, m_buffer, aligned, m_offset))
+        return false;
+    // The unaligned tail at the end of the file
+    if (final && m_used > aligned && !writeAll(m_fd, m_buffer + aligned, m_used - aligned, m_offset + aligned))
+        return false;
+    qint64 count = final ? m_used : aligned;
+    memmove(m_buffer, m_buffer + count, static_cast<size_t>(m_used - count));
+    m_used -= count;
+    m_offset += count;
+    return true;
+#else
+    Q_UNUSED(final);
+    return false;
+#endif
+}
+
+bool DirectFileWriter::close() {
+    bool ok = true;
+#ifdef Q_OS_LINUX
+    if (m_buffer && m_used > 0)
+        ok = flush(true);
+    if (m_directFd >= 0)
+        ::close(m_directFd);
+    if (m_fd >= 0)
+        ::close(m_fd);
+#endif
+    free(m_buffer);
+    m_buffer = nullptr;
+    m_fd = m_directFd = -1;
+    m_used = 0;
+    return ok;
+}
@@ -0,0 +1,75 @@
+#ifndef PAGECACHE_H
+#define PAGECACHE_H
+
+#include <QString>
+#include <QtGlobal>
+
+// Helpers that keep the multi-GB payload from pushing the host's own data
+// out of the page cache. They only do something on Linux.
+
+// Flushes a file being written front to back in windows and drops each
+// window from the cache once it is on disk.
+class WriteBehind {
+public:
+    WriteBehind(int fd, qint64 offset, qint64 window = 8 * 1024 * 1024);
+    // Everything before offset has been handed to the kernel
+    void advance(qint64 offset);
+    // Drops whatever is still cached
+    void finish();
+
+private:
+    int m_fd;
+    qint64 m_window;
+    qint64 m_started;   // writeback requested up to here
+    qint64 m_dropped;   // dropped from the cache up to here
+};
+
+// Read-ahead and drop-behind for a file someone else (bit7z) reads front to
+// back. Page cache state belongs to the file, so a descriptor of our own is
+// enough to steer it.
+class ReadAhead {
+public:
+    explicit ReadAhead(const QString &path, qint64 window = 32 * 1024 * 1024);
+    ~ReadAhead();
+    // The reader is at about offset
+    void advance(qint64 offset);
+    qint64 size() const { return m_size; }
+
+    static void drop(const QString &path);
+    // Starts reading all of path into the cache, for files about to be run
+    static void willNeed(const QString &path);
+    // How much of path is in the cache, -1 where that cannot be told
+    static qint64 cachedBytes(const QString &path);
+
+private:
+    int m_fd = -1;
+    qint64 m_size = 0;
+    qint64 m_window;
+    qint64 m_ahead = 0;     // read-ahead requested up to here
+    qint64 m_dropped = 0;
+};
+
+// Writes with O_DIRECT so payload data never enters the page cache. The
+// unaligned head and tail go through a normal descriptor. open() fails
+// where O_DIRECT is unsupported; callers then use buffered I/O.
+class DirectFileWriter {
+public:
+    DirectFileWriter() = default;
+    ~DirectFileWriter();
+
+    // Opens path for writing at offset, dropping anything after it
+    bool open(const QString &path, qint64 offset);
+    bool write(const char *data, qint64 size);
+    bool close();
+
+private:
+    bool flush(bool final);
+
+    int m_fd = -1;
+    int m_directFd = -1;
+    char *m_buffer = nullptr;
+    qint64 m_used = 0;
+    qint64 m_offset = 0;    // file offset of m_buffer[0]
+};
+
+#endif // PAGECACHE_H
@@ -0,0 +1,98 @@
+#include "payloadcache.h"
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QDateTime>
+#include <QStandardPaths>
+#include <QCryptographicHash>
+#include <QDebug>
+#include <algorithm>
+
+// Entries used this recently may still be extracted by another installer
+static const qint64 inUseGraceSecs = 60 * 60;
+// A download can legitimately hold a lock for a long time, but not this long;
+// QLockFile already reclaims locks of dead owners on this host, this also
+// covers holders that crashed on another host sharing the cache
+static const int staleLockMsecs = 6 * 60 * 60 * 1000;
+
+PayloadCache::PayloadCache(const QString &dir, qint64 capacity)
+    : m_dir(dir), m_capacity(capacity) {
+    QDir().mkpath(m_dir);
+}
+
+QString PayloadCache::defaultDir() {
+    return QStandardPaths::writableLocation(QStandardPaths::GenericCacheLocation) + "/ScrutaNet/payloads";
+}
+
+QString PayloadCache::keyFor(const Component &component) {
+    if (!component.sha256.isEmpty())
+        return component.sha256;
+
+    QByteArray id = QString("%1\n%2\n%3").arg(component.url, component.version).arg(component.size).toUtf8();
+    return "url-" + QCryptographicHash::hash(id, QCryptographicHash::Sha256).toHex();
+}
+
+QString PayloadCache::pathFor(const QString &key) const {
+    return m_dir + "/" + key + ".bin";
+}
+
+bool PayloadCache::isComplete(const QString &key, qint64 expectedSize) const {
+    QString path = pathFor(key);
+    if (QFile::exists(path + ".meta"))
+        return false;
+    qint64 size = QFileInfo(path).size();
+    return size > 0 && (expectedSize <= 0 || size == expectedSize);
+}
+
+void PayloadCache::touch(const QString &key) const {
+    QFile file(pathFor(key));
+    if (file.open(QIODevice::ReadWrite | QIODevice::ExistingOnly))
+        file.setFileTime(QDateTime::currentDateTime(), QFileDevice::FileModificationTime);
+}
+
+std::unique_ptr<QLockFile> PayloadCache::lock(const QString &key, const std::function<bool()> &canceled) const {
+    auto lockFile = std::make_unique<QLockFile>(m_dir + "/" + key + ".lock");
+    lockFile->setStaleLockTime(staleLockMsecs);
+
+    bool waiting = false;
+    while (!lockFile->tryLock(200)) {
+        if (lockFile->error() != QLockFile::LockFailedError) {
+            qWarning() << "Payload cache: cannot lock" << key << "in" << m_dir;
+            return nullptr;
+        }
+        if (canceled && canceled())
+            return nullptr;
+        if (!waiting) {
+            qDebug() << "Payload cache: waiting for another installer to finish" << key;
+            waiting = true;
+        }
+    }
+    return lockFile;
+}
+
+void PayloadCache::trim() const {
+    QFileInfoList entries = QDir(m_dir).entryInfoList({"*.bin"}, QDir::Files, QDir::Time | QDir::Reversed);
+
+    qint64 total = 0;
+    for (const QFileInfo &entry : std::as_const(entries))
+        total += entry.size();
+
+    QDateTime inUse = QDateTime::currentDateTime().addSecs(-inUseGraceSecs);
+    for (const QFileInfo &entry : std::as_const(entries)) {
+        if (total <= m_capacity)
+            break;
+        if (entry.lastModified() > inUse)
+            continue;
+
+        QString key = entry.completeBaseName();
+        QLockFile lockFile(m_dir + "/" + key + ".lock");
+        lockFile.setStaleLockTime(staleLockMsecs);
+        if (!lockFile.tryLock(0))
+            continue;
+
+        qDebug() << "Payload cache: evicting" << key << entry.size() << "bytes";
+        QFile::remove(entry.absoluteFilePath());
+        QFile::remove(entry.absoluteFilePath() + ".meta");
+        total -= entry.size();
+    }
+}
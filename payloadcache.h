@@ -0,0 +1,44 @@
+#ifndef PAYLOADCACHE_H
+#define PAYLOADCACHE_H
+
+#include <QString>
+#include <QLockFile>
+#include <functional>
+#include <memory>
+#include "manifest.h"
+
+// Per-user store of downloaded payloads, shared by every installer run and
+// version on the host. Payloads are named by content, so an installer that
+// finds its payload here never touches the network.
+class PayloadCache {
+public:
+    static constexpr qint64 defaultCapacity = 4LL * 1024 * 1024 * 1024;
+
+    explicit PayloadCache(const QString &dir = defaultDir(), qint64 capacity = defaultCapacity);
+    static QString defaultDir();
+
+    // The payload's SHA-256 when the manifest has one. Without it we only
+    // have the URL to go by, so the key includes the version and size too.
+    static QString keyFor(const Component &component);
+
+    QString dir() const { return m_dir; }
+    QString pathFor(const QString &key) const;
+
+    // Fully downloaded (no resume metadata) and, when known, the right size
+    bool isComplete(const QString &key, qint64 expectedSize) const;
+    // Marks the entry as recently used
+    void touch(const QString &key) const;
+
+    // Cross-process lock on one entry, so concurrent installers share a
+    // single download. Waits until it is free; nullptr if canceled first.
+    std::unique_ptr<QLockFile> lock(const QString &key, const std::function<bool()> &canceled) const;
+
+    // Removes least recently used payloads until the cache fits its capacity
+    void trim() const;
+
+private:
+    QString m_dir;
+    qint64 m_capacity;
+};
+
+#endif // PAYLOADCACHE_H
@@ -0,0 +1,288 @@
+#include "stagedinstall.h"
+#include <QDir>
+#include <QDirIterator>
+#include <QFile>
+#include <QFileInfo>
+#include <QDebug>
+
+#ifdef Q_OS_LINUX
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/fs.h>   // for FICLONE, RENAME_EXCHANGE
+#elif defined(Q_OS_WIN)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#elif defined(Q_OS_UNIX)
+#include <unistd.h>
+#endif
+
+StagedInstall::StagedInstall(const QString &installDir)
+    : m_installDir(QDir::cleanPath(installDir)) {
+}
+
+bool StagedInstall::begin(QString &error) {
+    QDir staging(stagingDir());
+    if (staging.exists() && !staging.removeRecursively()) {
+        error = "Cannot remove stale staging directory " + stagingDir();
+        return false;
+    }
+    if (!QDir().mkpath(stagingDir())) {
+        error = "Cannot create staging directory " + stagingDir();
+        return false;
+    }
+    return true;
+}
+
+bool StagedInstall::carryOver(const QString &relativePath, QString &error) const {
+    QString from = m_installDir + "/" + relativePath;
+    QString to = stagingDir() + "/" + relativePath;
+    QFileInfo source(from);
+
+    if (!QDir().mkpath(QFileInfo(to).path())) {
+        error = "Cannot create directory for " + to;
+        return false;
+    }
+
+    if (source.isSymLink()) {
+#ifdef Q_OS_UNIX
+        // Keep relative targets relative
+        QByteArray target(4096, '\0');
+        ssize_t n = ::readlink(QFile::encodeName(from).constData(), target.data(), target.size() - 1);
+        if (n > 0 && ::symlink(target.left(n).constData(), QFile::encodeName(to).constData()) == 0)
+            return true;
+#else
+        if (QFile::link(source.symLinkTarget(), to))
+            return true;
+#endif
+        error = "Cannot copy link " + from;
+        return false;
+    }
+
+    if (!reflink(from, to) && !hardLink(from, to) && !cloneFile(from, to)) {
+        error = "Cannot copy " + from;
+        return false;
+    }
+    return true;
+}
+
+bool StagedInstall::canLink() const {
+    QString probe = stagingDir() + "/.scrutanet-link-probe";
+    QFile file(probe);
+    if (!file.open(QIODevice::WriteOnly))
+        return false;
+    file.close();
+    bool linked = hardLink(probe, probe + "2");
+    QFile::remove(probe + "2");
+    QFile::remove(probe);
+    return linked;
+}
+
+bool StagedInstall::carryOverRemaining(const std::function<bool(const QString &)> &skip, QString &error,
+                                       const std::function<bool()> &canceled) const {
+    QDir live(m_installDir);
+    if (!live.exists())
+        return true;
+
+    QDirIterator it(m_installDir, QDir::AllEntries | QDir::Hidden | QDir::System | QDir::NoDotAndDotDot,
+                    QDirIterator::Subdirectories);
+    int carried = 0;
+    while (it.hasNext()) {
+        if (canceled && canceled()) {
+            error = "Carrying over files canceled";
+            return false;
+        }
+        QString path = it.next();
+        QFileInfo info = it.fileInfo();
+        QString relative = live.relativeFilePath(path);
+
+        if (info.isDir() && !info.isSymLink()) {
+            // Directories are created along with their files; only empty ones need it here
+            if (QDir(path).isEmpty() && !QDir().mkpath(stagingDir() + "/" + relative)) {
+                error = "Cannot create directory " + relative;
+                return false;
+            }
+            continue;
+        }
+
+        QFileInfo staged(stagingDir() + "/" + relative);
+        if (staged.exists() || staged.isSymLink() || skip(relative))
+            continue;
+        if (!carryOver(relative, error))
+            return false;
+        ++carried;
+    }
+    qDebug() << "Staged install: carried over" << carried << "files from" << m_installDir;
+    return true;
+}
+
+bool StagedInstall::commit(QString &error) {
+    QDir live(m_installDir);
+    bool hasLive = live.exists() && !live.isEmpty();
+
+    QDir previous(previousDir());
+    if (previous.exists() && !previous.removeRecursively()) {
+        error = "Cannot remove " + previousDir();
+        return false;
+    }
+
+    if (!hasLive) {
+        // First install: nothing to keep, the (empty) live directory just goes away
+        live.rmdir(m_installDir);
+        if (!QDir().rename(stagingDir(), m_installDir)) {
+            error = "Cannot move " + stagingDir() + " to " + m_installDir;
+            return false;
+        }
+        return true;
+    }
+
+    // One atomic swap where the kernel supports it, then park the old tree
+    if (exchange(stagingDir(), m_installDir)) {
+        if (!QDir().rename(stagingDir(), previousDir()))
+            qWarning() << "Staged install: could not keep previous version in" << previousDir();
+        return true;
+    }
+
+    if (!QDir().rename(m_installDir, previousDir())) {
+        error = "Cannot move " + m_installDir + " aside; is the application still running?";
+        return false;
+    }
+    if (!QDir().rename(stagingDir(), m_installDir)) {
+        QDir().rename(previousDir(), m_installDir);
+        error = "Cannot move " + stagingDir() + " to " + m_installDir;
+        return false;
+    }
+    return true;
+}
+
+bool StagedInstall::rollback(QString &error) {
+    if (!QDir(previousDir()).exists()) {
+        error = "No previous version in " + previousDir();
+        return false;
+    }
+
+    // The version we roll back from becomes the new "previous", so this can be undone too
+    if (exchange(previousDir(), m_installDir))
+        return true;
+
+    QDir staging(stagingDir());
+    if (staging.exists() && !staging.removeRecursively()) {
+        error = "Cannot remove " + stagingDir();
+        return false;
+    }
+    if (!QDir().rename(m_installDir, stagingDir())) {
+        error = "Cannot move " + m_installDir + " aside; is the application still running?";
+        return false;
+    }
+    if (!QDir().rename(previousDir(), m_installDir)) {
+        QDir().rename(stagingDir(), m_installDir);
+        error = "Cannot move " + previousDir() + " to " + m_installDir;
+        return false;
+    }
+    QDir().rename(stagingDir(), previousDir());
+    return true;
+}
+
+void StagedInstall::abort() {
+    if (!QDir(stagingDir()).removeRecursively())
+        qDebug() << "Staged install: could not remove" << stagingDir();
+}
+
+bool StagedInstall::exchange(const QString &a, const QString &b) {
+#if defined(Q_OS_LINUX) && defined(SYS_renameat2) && defined(RENAME_EXCHANGE)
+    // Not every filesystem implements it (EINVAL); callers fall back to two renames
+    return syscall(SYS_renameat2, AT_FDCWD, QFile::encodeName(a).constData(),
+                   AT_FDCWD, QFile::encodeName(b).constData(), RENAME_EXCHANGE) == 0;
+#else
+    Q_UNUSED(a);
+    Q_UNUSED(b);
+    return false;
+#endif
+}
+
+bool StagedInstall::cloneFile(const QString &from, const QString &to) {
+    QFile::remove(to);
+
+#ifdef Q_OS_LINUX
+    int in = ::open(QFile::encodeName(from).constData(), O_RDONLY | O_CLOEXEC);
+    if (in >= 0) {
+        struct stat st;
+        int out = -1;
+        if (fstat(in, &st) == 0)
+            out = ::open(QFile::encodeName(to).constData(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, st.st_mode & 07777);
+        if (out >= 0) {
+            // Shares extents on btrfs/XFS: no data is read or written
+            bool done = ioctl(out, FICLONE, in) == 0;
+
+            // In-kernel copy, which filesystems may still turn into a reflink
+            off_t remaining = st.st_size;
+            bool started = false;
+            while (!done && remaining > 0) {
+                ssize_t n = copy_file_range(in, nullptr, out, nullptr, remaining, 0);
+                if (n <= 0)
+                    break;
+                started = true;
+                remaining -= n;
+                done = remaining == 0;
+            }
+            if (st.st_size == 0)
+                done = true;
+
+            ::close(out);
+            ::close(in);
+            if (done)
+                return true;
+            QFile::remove(to);
+            if (started)
+                return false;
+        } else {
+            ::close(in);
+        }
+    }
+#endif
+
+    if (!QFile::copy(from, to))
+        return false;
+    QFile::setPermissions(to, QFile::permissions(from));
+    return true;
+}
+
+bool StagedInstall::reflink(const QString &from, const QString &to) {
+#ifdef Q_OS_LINUX
+    int in = ::open(QFile::encodeName(from).constData(), O_RDONLY | O_CLOEXEC);
+    if (in < 0)
+        return false;
+    struct stat st;
+    bool done = false;
+    if (fstat(in, &st) == 0) {
+        QFile::remove(to);
+        int out = ::open(QFile::encodeName(to).constData(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, st.st_mode & 07777);
+        if (out >= 0) {
+            done = ioctl(out, FICLONE, in) == 0;
+            ::close(out);
+            if (!done)
+                QFile::remove(to);
+        }
+    }
+    ::close(in);
+    return done;
+#else
+    Q_UNUSED(from);
+    Q_UNUSED(to);
+    return false;
+#endif
+}
+
+bool StagedInstall::hardLink(const QString &from, const QString &to) {
+    QFile::remove(to);
+#ifdef Q_OS_WIN
+    return CreateHardLinkW(reinterpret_cast<LPCWSTR>(QDir::toNativeSeparators(to).utf16()),
+                           reinterpret_cast<LPCWSTR>(QDir::toNativeSeparators(from).utf16()), nullptr);
+#else
+    return ::link(QFile::encodeName(from).constData(), QFile::encodeName(to).constData()) == 0;
+#endif
+}
@@ -0,0 +1,54 @@
+#ifndef STAGEDINSTALL_H
+#define STAGEDINSTALL_H
+
+#include <QString>
+#include <functional>
+
+// Installs into a sibling staging directory and swaps it with the live one in
+// a single rename, so an interrupted upgrade never leaves a half-old,
+// half-new tree. The replaced version is kept as <install>.previous until
+// the next upgrade, which makes rolling back a rename as well.
+class StagedInstall {
+public:
+    explicit StagedInstall(const QString &installDir);
+
+    QString installDir() const { return m_installDir; }
+    QString stagingDir() const { return m_installDir + ".staging"; }
+    QString previousDir() const { return m_installDir + ".previous"; }
+
+    // Clears whatever an interrupted run left behind and creates the staging dir
+    bool begin(QString &error);
+    // Brings relativePath from the live tree into staging without copying
+    // its data where possible: a reflink, else a hard link (the live file is
+    // never written, so the versions can share it), else a full copy
+    bool carryOver(const QString &relativePath, QString &error) const;
+    // Whether carryOver() can avoid copying in this staging directory. When
+    // it cannot, every carried file costs its full size on disk.
+    bool canLink() const;
+    // Brings over every live file that is not in staging yet, except those
+    // skip() says were dropped by the new version. Stops between files once
+    // canceled() returns true.
+    bool carryOverRemaining(const std::function<bool(const QString &)> &skip, QString &error,
+                            const std::function<bool()> &canceled = {}) const;
+    // Makes staging the live tree; the old one becomes previousDir()
+    bool commit(QString &error);
+    // Puts previousDir() back in place of the live tree
+    bool rollback(QString &error);
+    // Drops the staging dir after a failed or canceled install
+    void abort();
+
+    // FICLONE, then copy_file_range, then a plain copy. Keeps permissions.
+    static bool cloneFile(const QString &from, const QString &to);
+    // FICLONE only: shares the data but not the file; false where unsupported
+    static bool reflink(const QString &from, const QString &to);
+    // Makes to a second name of from. Fails across filesystems and where
+    // hard links are unsupported (FAT).
+    static bool hardLink(const QString &from, const QString &to);
+
+private:
+    static bool exchange(const QString &a, const QString &b);
+
+    QString m_installDir;
+};
+
+#endif // STAGEDINSTALL_H
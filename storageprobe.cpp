@@ -0,0 +1,205 @@
+#include "storageprobe.h"
+#include "lowimpact.h"
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QStorageInfo>
+#include <QElapsedTimer>
+#include <QThread>
+#include <QDebug>
+
+#ifdef Q_OS_WIN
+#include <io.h>      // for _commit
+#else
+#include <unistd.h>  // for fsync
+#endif
+
+static const qint64 sequentialProbeBytes = 32 * 1024 * 1024;
+static const int smallProbeFiles = 128;
+// Synced one at a time, so a cancel never waits on the whole probe reaching
+// a slow disk
+static const qint64 sequentialSyncBytes = 4 * 1024 * 1024;
+
+QString StorageProfile::kindName() const {
+    switch (kind) {
+    case Kind::NVMe: return "NVMe";
+    case Kind::SSD: return "SSD";
+    case Kind::HDD: return "HDD";
+    case Kind::Network: return "Network";
+    default: return "Unknown";
+    }
+}
+
+QString StorageProfile::summary() const {
+    return QString("%1 (%2 on %3): %4 MB/s sequential, %5 small files/s -> "
+                   "%6 extraction workers, %7 KB buffers")
+        .arg(kindName(), fileSystem, device)
+        .arg(sequentialWriteMBps, 0, 'f', 1)
+        .arg(smallFilesPerSec, 0, 'f', 0)
+        .arg(extractionWorkers)
+        .arg(bufferSize / 1024);
+}
+
+StorageProfile StorageProbe::probe(const QString &path, const std::function<bool()> &canceled) {
+    StorageProfile profile;
+    profile.path = path;
+
+    // The install directory may not exist yet; probe the closest parent that does
+    QDir dir(QDir::cleanPath(path));
+    while (!dir.exists() && !dir.isRoot()) {
+        if (!dir.cdUp())
+            break;
+    }
+
+    classify(profile, dir.absolutePath());
+    // Writing 32 MiB to a production disk is exactly what low-impact mode avoids
+    if (!LowImpact::isEnabled())
+        measure(profile, dir.absolutePath(), canceled);
+    tune(profile);
+    return profile;
+}
+
+void StorageProbe::classify(StorageProfile &profile, const QString &dir) {
+    QStorageInfo storage(dir);
+    profile.fileSystem = QString::fromLatin1(storage.fileSystemType());
+    profile.device = QString::fromLatin1(storage.device());
+
+    static const QStringList networkFileSystems = {
+        "nfs", "nfs4", "cifs", "smb3", "smbfs", "9p", "fuse.sshfs", "ceph", "glusterfs"
+    };
+    if (networkFileSystems.contains(profile.fileSystem.toLower())
+        || dir.startsWith("//") || dir.startsWith("\\\\")) {
+        profile.kind = StorageProfile::Kind::Network;
+        return;
+    }
+
+#ifdef Q_OS_LINUX
+    // /dev/mapper/x and friends are symlinks to the real dm-N node
+    QString node = QFileInfo(profile.device).canonicalFilePath();
+    if (node.isEmpty())
+        node = profile.device;
+    QString name = QFileInfo(node).fileName();
+    if (name.isEmpty())
+        return;
+
+    // Partitions have no queue/ of their own; their parent device does
+    QString sysPath = QFileInfo("/sys/class/block/" + name).canonicalFilePath();
+    QString rotationalPath = sysPath + "/queue/rotational";
+    if (!QFile::exists(rotationalPath))
+        rotationalPath = QFileInfo(sysPath).path() + "/queue/rotational";
+
+    QFile rotational(rotationalPath);
+    if (!rotational.open(QIODevice::ReadOnly))
+        return;
+    profile.rotational = rotational.readAll().trimmed() == "1";
+
+    if (profile.rotational) {
+        profile.kind = StorageProfile::Kind::HDD;
+    } else if (name.startsWith("nvme")) {
+        profile.kind = StorageProfile::Kind::NVMe;
+    } else {
+        profile.kind = StorageProfile::Kind::SSD;
+    }
+#endif
+}
+
+void StorageProbe::measure(StorageProfile &profile, const QString &dir, const std::function<bool()> &canceled) {
+    QString probeDir = dir + "/.scrutanet-storage-probe";
+    if (!QDir().mkpath(probeDir)) {
+        qDebug() << "Storage probe: cannot write to" << dir;
+        return;
+    }
+
+    // Sequential: large writes, flushed to the device as we go so the page
+    // cache does not hide the real throughput
+    QByteArray chunk(1024 * 1024, '\x5a');
+    QFile seq(probeDir + "/sequential.bin");
+    if (seq.open(QIODevice::WriteOnly)) {
+        QElapsedTimer timer;
+        timer.start();
+        qint64 written = 0;
+        while (written < sequentialProbeBytes) {
+            qint64 n = seq.write(chunk);
+            if (n <= 0)
+                break;
+            written += n;
+            if (written % sequentialSyncBytes != 0 && written < sequentialProbeBytes)
+                continue;
+            seq.flush();
+#ifdef Q_OS_WIN
+            _commit(seq.handle());
+#else
+            fsync(seq.handle());
+#endif
+            if (canceled && canceled()) {
+                seq.close();
+                QDir(probeDir).removeRecursively();
+                return;
+            }
+        }
+        double seconds = qMax<qint64>(timer.nsecsElapsed(), 1) / 1e9;
+        profile.sequentialWriteMBps = written / (1024.0 * 1024.0) / seconds;
+        seq.close();
+    }
+
+    // Small files: create/write/close cost dominates extraction of many tiny entries
+    QByteArray small(4096, '\x5a');
+    QElapsedTimer timer;
+    timer.start();
+    int created = 0;
+    for (int i = 0; i < smallProbeFiles && !(canceled && canceled()); ++i) {
+        QFile f(probeDir + QString("/small_%1.bin").arg(i));
+        if (!f.open(QIODevice::WriteOnly))
+            break;
+        f.write(small);
+        f.close();
+        ++created;
+    }
+    double seconds = qMax<qint64>(timer.nsecsElapsed(), 1) / 1e9;
+    profile.smallFilesPerSec = created / seconds;
+
+    QDir(probeDir).removeRecursively();
+}
+
+void StorageProbe::tune(StorageProfile &profile) {
+    int cores = qMax(1, QThread::idealThreadCount());
+
+    // Without a reliable device type fall back to what we measured
+    StorageProfile::Kind kind = profile.kind;
+    if (kind == StorageProfile::Kind::Unknown) {
+        if (profile.sequentialWriteMBps > 1000)
+            kind = StorageProfile::Kind::NVMe;
+        else if (profile.sequentialWriteMBps > 250)
+            kind = StorageProfile::Kind::SSD;
+        else if (profile.sequentialWriteMBps > 0)
+            kind = StorageProfile::Kind::HDD;
+    }
+
+    switch (kind) {
+    case StorageProfile::Kind::NVMe:
+        profile.extractionWorkers = qMin(cores, 8);
+        profile.bufferSize = 256 * 1024;
+        break;
+    case StorageProfile::Kind::SSD:
+        profile.extractionWorkers = qMin(cores, 4);
+        profile.bufferSize = 512 * 1024;
+        break;
+    case StorageProfile::Kind::HDD:
+        // Parallel writers make a spinning disk seek between them
+        profile.extractionWorkers = 1;
+        profile.bufferSize = 4 * 1024 * 1024;
+        break;
+    case StorageProfile::Kind::Network:
+        profile.extractionWorkers = 1;
+        profile.bufferSize = 1024 * 1024;
+        break;
+    default:
+        profile.extractionWorkers = qMin(cores, 2);
+        profile.bufferSize = 256 * 1024;
+        break;
+    }
+
+    if (LowImpact::isEnabled()) {
+        profile.extractionWorkers = 1;
+    }
+}
@@ -0,0 +1,42 @@
+#ifndef STORAGEPROBE_H
+#define STORAGEPROBE_H
+
+#include <QString>
+#include <QtGlobal>
+#include <functional>
+
+// What the install target looks like and how hard we should push it
+struct StorageProfile {
+    enum class Kind { Unknown, NVMe, SSD, HDD, Network };
+
+    QString path;
+    Kind kind = Kind::Unknown;
+    QString fileSystem;
+    QString device;
+    bool rotational = false;
+    double sequentialWriteMBps = 0;
+    double smallFilesPerSec = 0;
+
+    // Tuning derived from the above. Downloads are network-bound and go to
+    // the payload cache, so how many run at once is not the target's call.
+    int extractionWorkers = 2;      // concurrent extractions
+    qint64 bufferSize = 256 * 1024; // write buffer per download
+
+    QString kindName() const;
+    QString summary() const;
+};
+
+class StorageProbe {
+public:
+    // Classifies the storage behind path and runs a short write benchmark in
+    // the nearest existing directory. Takes well under a second on local
+    // disks; canceled stops the benchmark between flushed chunks.
+    static StorageProfile probe(const QString &path, const std::function<bool()> &canceled = {});
+
+private:
+    static void classify(StorageProfile &profile, const QString &dir);
+    static void measure(StorageProfile &profile, const QString &dir, const std::function<bool()> &canceled);
+    static void tune(StorageProfile &profile);
+};
+
+#endif // STORAGEPROBE_H
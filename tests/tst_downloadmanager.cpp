@@ -0,0 +1,231 @@
+#include "downloadmanager.h"
+#include <QtTest>
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QThread>
+#include <QTemporaryDir>
+#include <QCryptographicHash>
+#include <QRandomGenerator>
+#include <QSignalSpy>
+#include <QElapsedTimer>
+#include <curl/curl.h>
+#include <thread>
+
+// Local stand-in for a flaky payload server. Each GET takes the next fault
+// from the script, then behaves; HEAD always answers with the real size.
+class FlakyServer : public QObject {
+    Q_OBJECT
+public:
+    enum class Fault {
+        None,
+        Drop,           // half the body, then the connection closes
+        Truncate,       // a shorter Content-Length, so curl sees success
+        IgnoreRange     // 200 with the whole file to a range request
+    };
+
+    FlakyServer(const QByteArray &body, QList<Fault> script) : m_body(body), m_script(script) {}
+
+    // Reads requests but never answers any, HEAD included
+    void setSilent(bool silent) { m_silent = silent; }
+
+    // Listens on a free port on the server's own thread
+    quint16 listen() {
+        m_server = new QTcpServer(this);
+        connect(m_server, &QTcpServer::newConnection, this, &FlakyServer::accept);
+        return m_server->listen(QHostAddress::LocalHost) ? m_server->serverPort() : 0;
+    }
+
+    QList<qint64> rangeStarts() const {
+        QMutexLocker locker(&m_mutex);
+        return m_rangeStarts;
+    }
+
+private:
+    void accept() {
+        while (QTcpSocket *socket = m_server->nextPendingConnection()) {
+            connect(socket, &QTcpSocket::disconnected, socket, &QObject::deleteLater);
+            connect(socket, &QTcpSocket::readyRead, this, [this, socket]() { serve(socket); });
+        }
+    }
+
+    void serve(QTcpSocket *socket) {
+        QByteArray &request = m_pending[socket];
+        request += socket->readAll();
+        if (!request.contains("\r\n\r\n"))
+            return;
+        QList<QByteArray> lines = request.split('\n');
+        m_pending.remove(socket);
+        if (m_silent)
+            return;
+
+        bool head = lines.first().startsWith("HEAD");
+        qint64 from = 0;
+        for (const QByteArray &line : std::as_const(lines)) {
+            if (line.toLower().startsWith("range: bytes="))
+                from = line.mid(13).trimmed().split('-').first().toLongLong();
+        }
+        if (head) {
+            socket->write("HTTP/1.1 200 OK\r\nContent-Length: " + QByteArray::number(m_body.size())
+                          + "\r\nAccept-Ranges: bytes\r\nConnection: close\r\n\r\n");
+            socket->disconnectFromHost();
+            return;
+        }
+
+        Fault fault = m_script.isEmpty() ? Fault::None : m_script.takeFirst();
+        {
+            QMutexLocker locker(&m_mutex);
+            m_rangeStarts << from;
+        }
+        if (fault == Fault::IgnoreRange)
+            from = 0;
+        QByteArray body = m_body.mid(from);
+        QByteArray status = from > 0 ? "206 Partial Content" : "200 OK";
+        QByteArray range = from > 0 ? "Content-Range: bytes " + QByteArray::number(from) + "-"
+                                          + QByteArray::number(m_body.size() - 1) + "/"
+                                          + QByteArray::number(m_body.size()) + "\r\n"
+                                    : QByteArray();
+
+        qint64 length = body.size();
+        if (fault == Fault::Truncate)
+            length = body.size() / 3;
+        socket->write("HTTP/1.1 " + status + "\r\nContent-Length: " + QByteArray::number(length) + "\r\n"
+                      + range + "Connection: close\r\n\r\n");
+        if (fault == Fault::Drop)
+            socket->write(body.left(body.size() / 2));
+        else
+            socket->write(body.left(length));
+        socket->disconnectFromHost();
+    }
+
+    QByteArray m_body;
+    QList<Fault> m_script;
+    bool m_silent = false;
+    QTcpServer *m_server = nullptr;
+    QHash<QTcpSocket *, QByteArray> m_pending;
+    mutable QMutex m_mutex;
+    QList<qint64> m_rangeStarts;
+};
+
+class TestDownloadManager : public QObject {
+    Q_OBJECT
+private slots:
+    void initTestCase();
+    void cleanupTestCase();
+    void resumesThroughFaults();
+    void cancelIsPrompt_data();
+    void cancelIsPrompt();
+
+private:
+    // Starts server on its own thread, start() blocks the test's
+    QString serve(FlakyServer *server);
+
+    QThread m_serverThread;
+};
+
+static QByteArray randomBody(qsizetype size) {
+    QByteArray body(size, Qt::Uninitialized);
+    QRandomGenerator random(42);
+    random.fillRange(reinterpret_cast<quint32 *>(body.data()), body.size() / 4);
+    return body;
+}
+
+void TestDownloadManager::initTestCase() {
+    curl_global_init(CURL_GLOBAL_ALL);
+    m_serverThread.start();
+}
+
+void TestDownloadManager::cleanupTestCase() {
+    m_serverThread.quit();
+    m_serverThread.wait();
+    curl_global_cleanup();
+}
+
+QString TestDownloadManager::serve(FlakyServer *server) {
+    server->moveToThread(&m_serverThread);
+    quint16 port = 0;
+    QMetaObject::invokeMethod(server, [server, &port]() { port = server->listen(); }, Qt::BlockingQueuedConnection);
+    return QString("http://127.0.0.1:%1/payload.bin").arg(port);
+}
+
+void TestDownloadManager::resumesThroughFaults() {
+    QByteArray body = randomBody(4 * 1024 * 1024);
+
+    using Fault = FlakyServer::Fault;
+    auto *server = new FlakyServer(body, {Fault::Drop, Fault::Truncate, Fault::IgnoreRange});
+    QString url = serve(server);
+    QVERIFY(!url.endsWith(":0/payload.bin"));
+
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    QString path = dir.filePath("payload.bin");
+    DownloadManager download(url, path, nullptr);
+    download.start();
+
+    QVERIFY(download.succeeded());
+    QFile file(path);
+    QVERIFY(file.open(QIODevice::ReadOnly));
+    QCOMPARE(QCryptographicHash::hash(file.readAll(), QCryptographicHash::Sha256),
+             QCryptographicHash::hash(body, QCryptographicHash::Sha256));
+    QVERIFY(!QFile::exists(path + ".meta"));
+
+    // Resumed after the drop and the truncation, from scratch after the
+    // ignored range
+    QList<qint64> starts = server->rangeStarts();
+    QCOMPARE(starts.size(), 4);
+    QCOMPARE(starts[0], qint64(0));
+    QVERIFY(starts[1] > 0);
+    QVERIFY(starts[2] > starts[1]);
+    QCOMPARE(starts[3], qint64(0));
+    QCOMPARE(download.stats().failures, 3);
+
+    QMetaObject::invokeMethod(server, &QObject::deleteLater);
+}
+
+void TestDownloadManager::cancelIsPrompt_data() {
+    QTest::addColumn<QString>("request");
+    QTest::newRow("size") << "HEAD";
+    QTest::newRow("download") << "GET";
+    QTest::newRow("range") << "range";
+}
+
+// Every blocking request returns within CancelToken::boundMs of cancel(),
+// even while the server keeps the connection open without a word
+void TestDownloadManager::cancelIsPrompt() {
+    QFETCH(QString, request);
+    QByteArray body = randomBody(1024 * 1024);
+    auto *server = new FlakyServer(body, {});
+    server->setSilent(true);
+    QString url = serve(server);
+
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    auto token = std::make_shared<CancelToken>();
+    DownloadManager download(url, dir.filePath("payload.bin"), token);
+    if (request == "GET")
+        download.setExpectedTotal(body.size());
+    QSignalSpy finished(&download, &DownloadManager::finished);
+
+    QElapsedTimer sinceCancel;
+    std::thread canceler([&]() {
+        QThread::msleep(300);
+        sinceCancel.start();
+        token->cancel();
+    });
+    if (request == "range") {
+        QByteArray data;
+        QString error;
+        QVERIFY(!DownloadManager::fetchRange(url, 0, 4096, data, error, token.get()));
+    } else {
+        download.start();
+        QVERIFY(!download.succeeded());
+        QCOMPARE(finished.count(), 1);
+    }
+    canceler.join();
+    qint64 ms = sinceCancel.elapsed();
+    QVERIFY2(ms <= CancelToken::boundMs, qPrintable(QString("%1 returned %2 ms after cancel").arg(request).arg(ms)));
+
+    QMetaObject::invokeMethod(server, &QObject::deleteLater);
+}
+
+QTEST_GUILESS_MAIN(TestDownloadManager)
+#include "tst_downloadmanager.moc"
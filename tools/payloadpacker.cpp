@@ -0,0 +1,373 @@
+// payload-packer: builds installer payloads from a directory.
+//
+// Instead of one solid archive, files are packed into independent 7z blocks
+// of roughly --block-size MiB. Each block can be downloaded, verified,
+// extracted or re-fetched on its own, so the installer can extract blocks in
+// parallel and while later ones are still downloading. Alongside the blocks
+// it writes <name>.chunks.json with the chunk list, a per-file index (block,
+// archive index, size, CRC, SHA-256) and the block hashes.
+//
+//   payload-packer [options] <source-dir> <output-dir>
+
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QDir>
+#include <QDirIterator>
+#include <QFile>
+#include <QFileInfo>
+#include <QElapsedTimer>
+#include <QCryptographicHash>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QSaveFile>
+#include <QTextStream>
+#include <algorithm>
+#include <bit7z/bit7zlibrary.hpp>
+#include <bit7z/bitfilecompressor.hpp>
+#include <bit7z/bitfileextractor.hpp>
+#include <bit7z/bitinputarchive.hpp>
+#include <bit7z/bitexception.hpp>
+
+struct InputFile {
+    QString path;       // relative to the source directory, '/' separated
+    qint64 size = 0;
+    uint32_t index = 0; // inside its block
+    uint32_t crc = 0;
+    QByteArray sha256;
+};
+
+struct Block {
+    QList<InputFile> files;
+    qint64 size = 0;
+    QString fileName;
+    qint64 packedSize = 0;
+    QByteArray sha256;
+    qint64 compressMs = 0;
+    qint64 decodeMs = 0;
+};
+
+static QTextStream out(stdout);
+static QTextStream err(stderr);
+
+static QByteArray sha256Of(const QString &path) {
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly))
+        return {};
+    QCryptographicHash hash(QCryptographicHash::Sha256);
+    hash.addData(&file);
+    return hash.result().toHex();
+}
+
+static bit7z::BitCompressionLevel compressionLevel(int level) {
+    if (level <= 0) return bit7z::BitCompressionLevel::None;
+    if (level <= 1) return bit7z::BitCompressionLevel::Fastest;
+    if (level <= 3) return bit7z::BitCompressionLevel::Fast;
+    if (level <= 5) return bit7z::BitCompressionLevel::Normal;
+    if (level <= 7) return bit7z::BitCompressionLevel::Max;
+    return bit7z::BitCompressionLevel::Ultra;
+}
+
+// Similar files next to each other compress better, and keeping a directory
+// together means a block finishes whole parts of the tree
+static QList<InputFile> collectFiles(const QString &sourceDir) {
+    QList<InputFile> files;
+    QDir root(sourceDir);
+    QDirIterator it(sourceDir, QDir::Files | QDir::Hidden | QDir::NoSymLinks, QDirIterator::Subdirectories);
+    while (it.hasNext()) {
+        it.next();
+        InputFile file;
+        file.path = root.relativeFilePath(it.filePath());
+        file.size = it.fileInfo().size();
+        files.append(file);
+    }
+
+    std::sort(files.begin(), files.end(), [](const InputFile &a, const InputFile &b) {
+        QString dirA = QFileInfo(a.path).path(), dirB = QFileInfo(b.path).path();
+        if (dirA != dirB)
+            return dirA < dirB;
+        QString extA = QFileInfo(a.path).suffix(), extB = QFileInfo(b.path).suffix();
+        if (extA != extB)
+            return extA < extB;
+        return a.path < b.path;
+    });
+    return files;
+}
+
+static QList<Block> planBlocks(const QList<InputFile> &files, qint64 blockSize) {
+    QList<Block> blocks;
+    Block current;
+    for (const InputFile &file : files) {
+        if (!current.files.isEmpty() && current.size + file.size > blockSize) {
+            blocks.append(current);
+            current = Block();
+        }
+        current.files.append(file);
+        current.size += file.size;
+    }
+    if (!current.files.isEmpty())
+        blocks.append(current);
+    return blocks;
+}
+
+static bool packBlock(const bit7z::Bit7zLibrary &lib, const QString &sourceDir, const QString &archivePath,
+                      const QList<InputFile> &files, int level, const QString &password,
+                      qint64 &compressMs, QString &error) {
+    // Relative paths keep their directory structure inside the archive
+    std::vector<bit7z::tstring> paths;
+    paths.reserve(files.size());
+    for (const InputFile &file : files)
+        paths.push_back(file.path.toStdString());
+
+    QFile::remove(archivePath);
+    QString previousDir = QDir::currentPath();
+    QDir::setCurrent(sourceDir);
+    try {
+        bit7z::BitFileCompressor compressor(lib, bit7z::BitFormat::SevenZip);
+        compressor.setCompressionLevel(compressionLevel(level));
+        compressor.setSolidMode(true);
+        if (!password.isEmpty())
+            compressor.setPassword(password.toStdString());
+
+        QElapsedTimer timer;
+        timer.start();
+        compressor.compressFiles(paths, archivePath.toStdString());
+        compressMs = timer.elapsed();
+    } catch (const bit7z::BitException &e) {
+        error = QString::fromUtf8(e.what());
+        QDir::setCurrent(previousDir);
+        return false;
+    }
+    QDir::setCurrent(previousDir);
+    return true;
+}
+
+// Reads back CRCs and archive indices, and times a full decode without writing
+static bool inspectBlock(const bit7z::Bit7zLibrary &lib, Block &block, const QString &archivePath,
+                         const QString &password, QString &error) {
+    try {
+        bit7z::BitFileExtractor extractor(lib, bit7z::BitFormat::SevenZip);
+        if (!password.isEmpty())
+            extractor.setPassword(password.toStdString());
+
+        QHash<QString, int> byPath;
+        for (int i = 0; i < block.files.size(); ++i)
+            byPath.insert(block.files[i].path, i);
+
+        bit7z::BitInputArchive archive(extractor, archivePath.toStdString());
+        for (const auto &item : archive) {
+            if (item.isDir())
+                continue;
+            auto it = byPath.constFind(QDir::fromNativeSeparators(QString::fromStdString(item.path())));
+            if (it == byPath.constEnd())
+                continue;
+            block.files[*it].index = item.index();
+            block.files[*it].crc = item.crc();
+        }
+
+        QElapsedTimer timer;
+        timer.start();
+        extractor.test(archivePath.toStdString());
+        block.decodeMs = timer.elapsed();
+    } catch (const bit7z::BitException &e) {
+        error = QString::fromUtf8(e.what());
+        return false;
+    }
+    return true;
+}
+
+// Longest-first onto the least loaded worker, which is how the installer's
+// extraction limit plays out
+static qint64 projectedDecodeMs(QList<qint64> durations, int workers) {
+    std::sort(durations.begin(), durations.end(), std::greater<qint64>());
+    std::vector<qint64> load(workers, 0);
+    for (qint64 d : durations)
+        *std::min_element(load.begin(), load.end()) += d;
+    return *std::max_element(load.begin(), load.end());
+}
+
+static QByteArray chunkManifest(const QString &name, const QString &version, qint64 blockSize, int level,
+                                const QList<Block> &blocks) {
+    QJsonArray chunks;
+    QJsonArray files;
+    for (int b = 0; b < blocks.size(); ++b) {
+        const Block &block = blocks[b];
+        chunks.append(QJsonObject{
+            {"file", block.fileName},
+            {"size", block.packedSize},
+            {"sha256", QString::fromLatin1(block.sha256)},
+            {"unpackedSize", block.size},
+            {"files", block.files.size()}});
+        for (const InputFile &file : block.files) {
+            files.append(QJsonObject{
+                {"path", file.path},
+                {"size", file.size},
+                {"crc", static_cast<qint64>(file.crc)},
+                {"sha256", QString::fromLatin1(file.sha256)},
+                {"chunk", b},
+                {"index", static_cast<qint64>(file.index)}});
+        }
+    }
+
+    QJsonObject root;
+    root["name"] = name;
+    if (!version.isEmpty())
+        root["version"] = version;
+    root["blockSize"] = blockSize;
+    root["level"] = level;
+    root["chunks"] = chunks;
+    root["files"] = files;
+    return QJsonDocument(root).toJson();
+}
+
+// The component entry for the installer manifest, one volume per block
+static QByteArray componentEntry(const QString &name, const QString &version, const QString &baseUrl,
+                                 const QList<Block> &blocks) {
+    QJsonArray volumes;
+    for (const Block &block : blocks) {
+        volumes.append(QJsonObject{
+            {"url", baseUrl + block.fileName},
+            {"size", block.packedSize},
+            {"sha256", QString::fromLatin1(block.sha256)}});
+    }
+    QJsonObject component{{"name", name}, {"volumes", volumes}};
+    if (!version.isEmpty())
+        component["version"] = version;
+    return QJsonDocument(component).toJson();
+}
+
+int main(int argc, char *argv[]) {
+    QCoreApplication app(argc, argv);
+    QCoreApplication::setApplicationName("payload-packer");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Packs a directory into independently decodable installer payload blocks.");
+    parser.addHelpOption();
+    parser.addPositionalArgument("source", "Directory to pack.");
+    parser.addPositionalArgument("output", "Directory for the blocks and the chunk manifest.");
+    QCommandLineOption nameOption("name", "Base name of the output files.", "name", "payload");
+    QCommandLineOption versionOption("version", "Version recorded in the chunk manifest.", "version");
+    QCommandLineOption blockOption("block-size", "Target uncompressed block size in MiB.", "MiB", "64");
+    QCommandLineOption levelOption("level", "Compression level, 0-9.", "level", "9");
+    QCommandLineOption passwordOption("password", "Archive password.", "password");
+#ifdef _WIN32
+    QCommandLineOption codecOption("codec", "Path to 7z.dll.", "path", "7z.dll");
+#else
+    QCommandLineOption codecOption("codec", "Path to 7z.so.", "path", "7z.so");
+#endif
+    QCommandLineOption compareOption("compare", "Also pack everything as one solid block and compare.");
+    QCommandLineOption urlOption("url", "URL the blocks will be published under; prints the installer manifest entry.", "url");
+    parser.addOptions({nameOption, versionOption, blockOption, levelOption, passwordOption, codecOption, compareOption,
+                       urlOption});
+    parser.process(app);
+
+    const QStringList args = parser.positionalArguments();
+    if (args.size() != 2)
+        parser.showHelp(1);
+
+    QString sourceDir = QDir(args[0]).absolutePath();
+    QString outputDir = QDir(args[1]).absolutePath();
+    QString name = parser.value(nameOption);
+    qint64 blockSize = parser.value(blockOption).toLongLong() * 1024 * 1024;
+    int level = parser.value(levelOption).toInt();
+    QString password = parser.value(passwordOption);
+
+    if (!QDir(sourceDir).exists() || blockSize <= 0) {
+        err << "Nothing to pack in " << sourceDir << Qt::endl;
+        return 1;
+    }
+    QDir().mkpath(outputDir);
+
+    QList<InputFile> files = collectFiles(sourceDir);
+    for (InputFile &file : files)
+        file.sha256 = sha256Of(sourceDir + "/" + file.path);
+    QList<Block> blocks = planBlocks(files, blockSize);
+    out << files.size() << " files in " << blocks.size() << " blocks" << Qt::endl;
+
+    try {
+        bit7z::Bit7zLibrary lib(parser.value(codecOption).toStdString());
+
+        int width = QString::number(blocks.size()).size() < 3 ? 3 : QString::number(blocks.size()).size();
+        for (int b = 0; b < blocks.size(); ++b) {
+            Block &block = blocks[b];
+            block.fileName = QString("%1-%2.7z").arg(name).arg(b + 1, width, 10, QChar('0'));
+            QString archivePath = outputDir + "/" + block.fileName;
+
+            QString error;
+            if (!packBlock(lib, sourceDir, archivePath, block.files, level, password, block.compressMs, error)
+                || !inspectBlock(lib, block, archivePath, password, error)) {
+                err << block.fileName << ": " << error << Qt::endl;
+                return 1;
+            }
+            block.packedSize = QFileInfo(archivePath).size();
+            block.sha256 = sha256Of(archivePath);
+
+            out << QString("%1  %2 files  %3 -> %4 MiB  packed in %5 ms, decodes in %6 ms")
+                       .arg(block.fileName)
+                       .arg(block.files.size(), 6)
+                       .arg(block.size / 1048576.0, 8, 'f', 1)
+                       .arg(block.packedSize / 1048576.0, 8, 'f', 1)
+                       .arg(block.compressMs)
+                       .arg(block.decodeMs)
+                << Qt::endl;
+        }
+
+        QSaveFile manifest(outputDir + "/" + name + ".chunks.json");
+        if (!manifest.open(QIODevice::WriteOnly)) {
+            err << "Cannot write " << manifest.fileName() << Qt::endl;
+            return 1;
+        }
+        manifest.write(chunkManifest(name, parser.value(versionOption), blockSize, level, blocks));
+        if (!manifest.commit()) {
+            err << "Cannot write " << manifest.fileName() << Qt::endl;
+            return 1;
+        }
+
+        if (parser.isSet(urlOption)) {
+            QString baseUrl = parser.value(urlOption);
+            if (!baseUrl.endsWith('/'))
+                baseUrl += '/';
+            out << Qt::endl << "Installer manifest entry:" << Qt::endl
+                << componentEntry(name, parser.value(versionOption), baseUrl, blocks);
+        }
+
+        // The trade-off: what the blocks cost in ratio, and what they buy in decode time
+        qint64 unpacked = 0, packed = 0;
+        QList<qint64> decode;
+        for (const Block &block : std::as_const(blocks)) {
+            unpacked += block.size;
+            packed += block.packedSize;
+            decode << block.decodeMs;
+        }
+        out << Qt::endl << QString("Blocks: ratio %1%, projected decode").arg(100.0 * packed / qMax<qint64>(unpacked, 1), 0, 'f', 1);
+        for (int workers : {1, 2, 4, 8})
+            out << QString("  %1 ms with %2 worker%3").arg(projectedDecodeMs(decode, workers)).arg(workers).arg(workers > 1 ? "s" : "");
+        out << Qt::endl;
+
+        if (parser.isSet(compareOption)) {
+            Block solid;
+            solid.files = files;
+            solid.size = unpacked;
+            QString solidPath = outputDir + "/" + name + ".solid-compare.7z";
+            QString error;
+            if (!packBlock(lib, sourceDir, solidPath, files, level, password, solid.compressMs, error)
+                || !inspectBlock(lib, solid, solidPath, password, error)) {
+                err << "Solid comparison: " << error << Qt::endl;
+                return 1;
+            }
+            solid.packedSize = QFileInfo(solidPath).size();
+            QFile::remove(solidPath);
+            out << QString("Single solid block: ratio %1%, decode %2 ms on one worker, %3 KiB smaller than the blocks")
+                       .arg(100.0 * solid.packedSize / qMax<qint64>(unpacked, 1), 0, 'f', 1)
+                       .arg(solid.decodeMs)
+                       .arg((packed - solid.packedSize) / 1024)
+                << Qt::endl;
+        }
+    } catch (const bit7z::BitException &e) {
+        err << "bit7z: " << e.what() << Qt::endl;
+        return 1;
+    }
+
+    out << "Wrote " << outputDir << "/" << name << ".chunks.json" << Qt::endl;
+    return 0;
+}
@@ -0,0 +1,109 @@
+#include "tracer.h"
+#include <QCoreApplication>
+#include <QThread>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QSaveFile>
+#include <QDebug>
+
+std::atomic<bool> Tracer::s_enabled{false};
+
+Tracer &Tracer::instance() {
+    static Tracer tracer;
+    return tracer;
+}
+
+void Tracer::enable(const QString &path) {
+    QMutexLocker locker(&m_mutex);
+    m_path = path;
+    m_clock.start();
+    m_events.reserve(4096);
+    s_enabled.store(true, std::memory_order_relaxed);
+    qDebug() << "Tracing to" << path;
+}
+
+qint64 Tracer::now() const {
+    return m_clock.nsecsElapsed() / 1000;
+}
+
+int Tracer::threadId() {
+    // Callers hold m_mutex
+    quintptr key = reinterpret_cast<quintptr>(QThread::currentThreadId());
+    auto it = m_threads.constFind(key);
+    if (it != m_threads.constEnd())
+        return it.value();
+
+    int tid = m_threads.size() + 1;
+    m_threads.insert(key, tid);
+    QThread *thread = QThread::currentThread();
+    QString name = thread->objectName();
+    if (thread == QCoreApplication::instance()->thread())
+        name = "GUI";
+    else if (name.isEmpty() || name.startsWith("Thread (pooled)"))
+        name = QString("Worker %1").arg(tid);
+    m_threadNames.insert(tid, name);
+    return tid;
+}
+
+void Tracer::complete(const char *category, const QString &name, qint64 startUs, qint64 durationUs,
+                      const QVariantMap &args) {
+    if (!isEnabled())
+        return;
+    QMutexLocker locker(&m_mutex);
+    m_events.push_back({'X', category, name, startUs, durationUs, threadId(), args});
+}
+
+void Tracer::instant(const char *category, const QString &name, const QVariantMap &args) {
+    if (!isEnabled())
+        return;
+    qint64 ts = now();
+    QMutexLocker locker(&m_mutex);
+    m_events.push_back({'i', category, name, ts, 0, threadId(), args});
+}
+
+void Tracer::nameThread(const QString &name) {
+    if (!isEnabled())
+        return;
+    QMutexLocker locker(&m_mutex);
+    m_threadNames.insert(threadId(), name);
+}
+
+bool Tracer::flush() {
+    if (!isEnabled())
+        return true;
+    QMutexLocker locker(&m_mutex);
+
+    const qint64 pid = QCoreApplication::applicationPid();
+    QJsonArray events;
+    for (auto it = m_threadNames.constBegin(); it != m_threadNames.constEnd(); ++it) {
+        events.append(QJsonObject{
+            {"ph", "M"}, {"name", "thread_name"}, {"pid", pid}, {"tid", it.key()},
+            {"args", QJsonObject{{"name", it.value()}}}});
+    }
+    for (const Event &event : m_events) {
+        QJsonObject obj{
+            {"ph", QString(QChar(event.phase))}, {"cat", event.category}, {"name", event.name},
+            {"ts", event.ts}, {"pid", pid}, {"tid", event.tid}};
+        if (event.phase == 'X')
+            obj["dur"] = event.dur;
+        else
+            obj["s"] = "t";
+        if (!event.args.isEmpty())
+            obj["args"] = QJsonObject::fromVariantMap(event.args);
+        events.append(obj);
+    }
+
+    QSaveFile file(m_path);
+    if (!file.open(QIODevice::WriteOnly)) {
+        qWarning() << "Cannot write trace to" << m_path;
+        return false;
+    }
+    file.write(QJsonDocument(QJsonObject{{"traceEvents", events}, {"displayTimeUnit", "ms"}}).toJson(QJsonDocument::Compact));
+    if (!file.commit()) {
+        qWarning() << "Cannot write trace to" << m_path;
+        return false;
+    }
+    qDebug() << "Trace with" << m_events.size() << "events written to" << m_path;
+    return true;
+}
@@ -0,0 +1,86 @@
+#ifndef TRACER_H
+#define TRACER_H
+
+#include <QString>
+#include <QHash>
+#include <QMutex>
+#include <QElapsedTimer>
+#include <QVariantMap>
+#include <atomic>
+#include <vector>
+
+// Opt-in recorder of where install time goes, written as Chrome trace-event
+// JSON (open it in ui.perfetto.dev or chrome://tracing). Enabled with
+// --trace <file> or SCRUTANET_TRACE=<file>. When disabled every call is a
+// single relaxed atomic load.
+class Tracer {
+public:
+    static Tracer &instance();
+
+    static bool isEnabled() { return s_enabled.load(std::memory_order_relaxed); }
+    void enable(const QString &path);
+    // Writes everything recorded so far
+    bool flush();
+
+    // Microseconds since tracing was enabled
+    qint64 now() const;
+
+    // A span of work on the calling thread
+    void complete(const char *category, const QString &name, qint64 startUs, qint64 durationUs,
+                  const QVariantMap &args = {});
+    // A point in time on the calling thread
+    void instant(const char *category, const QString &name, const QVariantMap &args = {});
+    // Names the calling thread's track
+    void nameThread(const QString &name);
+
+private:
+    struct Event {
+        char phase;
+        const char *category;
+        QString name;
+        qint64 ts;
+        qint64 dur;
+        int tid;
+        QVariantMap args;
+    };
+
+    Tracer() = default;
+    int threadId();
+
+    static std::atomic<bool> s_enabled;
+    QString m_path;
+    QElapsedTimer m_clock;
+    QMutex m_mutex;
+    std::vector<Event> m_events;
+    QHash<quintptr, int> m_threads;
+    QHash<int, QString> m_threadNames;
+};
+
+// Records its own lifetime as a span
+class TraceScope {
+public:
+    TraceScope(const char *category, const char *name, const QString &detail = QString())
+        : m_category(category), m_name(name), m_detail(detail),
+          m_start(Tracer::isEnabled() ? Tracer::instance().now() : -1) {}
+    ~TraceScope() {
+        if (m_start >= 0) {
+            Tracer &tracer = Tracer::instance();
+            QVariantMap args;
+            if (!m_detail.isEmpty())
+                args["detail"] = m_detail;
+            tracer.complete(m_category, m_detail.isEmpty() ? QString(m_name) : QString("%1 %2").arg(m_name, m_detail),
+                            m_start, tracer.now() - m_start, args);
+        }
+    }
+
+    TraceScope(const TraceScope &) = delete;
+    TraceScope &operator=(const TraceScope &) = delete;
+
+private:
+    const char *m_category;
+    const char *m_name;
+    QString m_detail;
+    qint64 m_start;
+};
+
+#endif // TRACER_H
@@ -0,0 +1,183 @@
+#include "uimonitor.h"
+#include "tracer.h"
+#include <QMetaEnum>
+#include <QAbstractEventDispatcher>
+#include <QThread>
+#include <QDebug>
+#include <algorithm>
+
+static const int heartbeatMs = 10;
+// Beats later than this count as a stall the user can feel
+static const qint64 stallUs = 100000;
+// Events shorter than a frame are not worth naming
+static const qint64 blockedNs = 16000000;
+
+bool UiMonitor::s_enabled = false;
+// Set by nameCall() while MonitoredApplication dispatches a queued call
+static thread_local const char *currentCallSite = nullptr;
+
+UiMonitor &UiMonitor::instance() {
+    static UiMonitor monitor;
+    return monitor;
+}
+
+void UiMonitor::start() {
+    if (s_enabled)
+        return;
+    s_enabled = true;
+    m_clock.start();
+    m_lastBeatUs = 0;
+    // The monitor outlives the application, its timer must not
+    m_timer = new QTimer(this);
+    m_timer->setTimerType(Qt::PreciseTimer);
+    m_timer->setInterval(heartbeatMs);
+    connect(m_timer, &QTimer::timeout, this, [this]() { beat(); });
+    connect(qApp, &QCoreApplication::aboutToQuit, this, [this]() {
+        delete m_timer;
+        m_timer = nullptr;
+    });
+    m_timer->start();
+    qDebug() << "UI monitor: heartbeat every" << heartbeatMs << "ms";
+}
+
+void UiMonitor::reset() {
+    m_histogram.fill(0);
+    m_beats = 0;
+    m_maxLagUs = 0;
+    m_stalls = 0;
+    m_offenders.clear();
+    m_lastBeatUs = m_clock.nsecsElapsed() / 1000;
+}
+
+void UiMonitor::beat() {
+    qint64 now = m_clock.nsecsElapsed() / 1000;
+    qint64 lag = qMax<qint64>(0, now - m_lastBeatUs - heartbeatMs * 1000);
+    m_lastBeatUs = now;
+
+    m_histogram[std::min<size_t>(lag / 1000, m_histogram.size() - 1)]++;
+    m_beats++;
+    m_maxLagUs = qMax(m_maxLagUs, lag);
+    if (lag >= stallUs) {
+        m_stalls++;
+        if (Tracer::isEnabled()) {
+            Tracer &tracer = Tracer::instance();
+            tracer.complete("ui", "stall", tracer.now() - lag, lag);
+        }
+    }
+}
+
+void UiMonitor::nameCall(const char *site) {
+    currentCallSite = site;
+}
+
+void UiMonitor::eventBlocked(const QString &what, qint64 us) {
+    Offender &offender = m_offenders[what];
+    offender.count++;
+    offender.totalUs += us;
+    offender.maxUs = qMax(offender.maxUs, us);
+}
+
+double UiMonitor::latencyMs(double q) const {
+    if (m_beats == 0)
+        return 0;
+    quint64 wanted = static_cast<quint64>(q * m_beats);
+    quint64 seen = 0;
+    for (size_t ms = 0; ms < m_histogram.size(); ++ms) {
+        seen += m_histogram[ms];
+        if (seen > wanted)
+            return ms;
+    }
+    return m_histogram.size() - 1;
+}
+
+QString UiMonitor::report() const {
+    QStringList lines;
+    lines << QString("UI latency: %1 beats, p50 %2 ms, p90 %3 ms, p99 %4 ms, max %5 ms, %6 stalls over %7 ms")
+                 .arg(m_beats)
+                 .arg(latencyMs(0.5))
+                 .arg(latencyMs(0.9))
+                 .arg(latencyMs(0.99))
+                 .arg(m_maxLagUs / 1000)
+                 .arg(m_stalls)
+                 .arg(stallUs / 1000);
+
+    const int bounds[] = {1, 4, 16, 50, 100, 250, 1000};
+    size_t from = 0;
+    for (int bound : bounds) {
+        quint64 count = 0;
+        for (size_t ms = from; ms < size_t(bound); ++ms)
+            count += m_histogram[ms];
+        lines << QString("  %1-%2 ms: %3").arg(from, 4).arg(bound, 4).arg(count);
+        from = bound;
+    }
+    lines << QString("  >= 1000 ms: %1").arg(m_histogram.back());
+
+    // Worst first by total time blocked
+    QList<QPair<QString, Offender>> offenders;
+    for (auto it = m_offenders.cbegin(); it != m_offenders.cend(); ++it)
+        offenders.append({it.key(), it.value()});
+    std::sort(offenders.begin(), offenders.end(), [](const auto &a, const auto &b) {
+        return a.second.totalUs > b.second.totalUs;
+    });
+    if (!offenders.isEmpty())
+        lines << "Longest GUI-thread events:";
+    for (int i = 0; i < offenders.size() && i < 10; ++i) {
+        const Offender &o = offenders[i].second;
+        lines << QString("  %1 ms total, %2 ms max, %3x  %4")
+                     .arg(o.totalUs / 1000, 6)
+                     .arg(o.maxUs / 1000, 5)
+                     .arg(o.count, 4)
+                     .arg(offenders[i].first);
+    }
+    return lines.join('\n');
+}
+
+bool MonitoredApplication::notify(QObject *receiver, QEvent *event) {
+    if (!UiMonitor::isEnabled() || QThread::currentThread() != thread())
+        return QApplication::notify(receiver, event);
+    if (!m_clock.isValid()) {
+        m_clock.start();
+        // A nested loop waiting for input (modal dialog) is not blocking
+        QAbstractEventDispatcher *dispatcher = QAbstractEventDispatcher::instance(thread());
+        connect(dispatcher, &QAbstractEventDispatcher::aboutToBlock, this, [this]() {
+            m_idleSince = m_clock.nsecsElapsed();
+        });
+        connect(dispatcher, &QAbstractEventDispatcher::awake, this, [this]() {
+            if (m_idleSince >= 0 && m_depth > 0)
+                m_nestedNs += m_clock.nsecsElapsed() - m_idleSince;
+            m_idleSince = -1;
+        });
+    }
+
+    // Named up front, the receiver may be gone afterwards
+    const char *className = receiver->metaObject()->className();
+    QString objectName = receiver->objectName();
+    QEvent::Type type = event->type();
+
+    // Time spent in events this one dispatched (a modal dialog's own loop,
+    // sendEvent) is theirs, not this event's
+    qint64 outerNested = m_nestedNs;
+    m_nestedNs = 0;
+    const char *outerSite = currentCallSite;
+    currentCallSite = nullptr;
+    m_depth++;
+    qint64 start = m_clock.nsecsElapsed();
+    bool result = QApplication::notify(receiver, event);
+    qint64 total = m_clock.nsecsElapsed() - start;
+    m_depth--;
+    qint64 own = total - m_nestedNs;
+    m_nestedNs = outerNested + total;
+    const char *site = currentCallSite;
+    currentCallSite = outerSite;
+
+    if (own > blockedNs) {
+        const char *typeName = QMetaEnum::fromType<QEvent::Type>().valueToKey(type);
+        QString what = site ? QString("queued %1").arg(site)
+                       : type == QEvent::MetaCall ? QString("queued call")
+                       : typeName ? QString(typeName) : QString("event %1").arg(int(type));
+        if (!objectName.isEmpty())
+            what = objectName + " " + what;
+        UiMonitor::instance().eventBlocked(QString("%1: %2").arg(className, what), own / 1000);
+    }
+    return result;
+}
@@ -0,0 +1,73 @@
+#ifndef UIMONITOR_H
+#define UIMONITOR_H
+
+#include <QApplication>
+#include <QElapsedTimer>
+#include <QHash>
+#include <QString>
+#include <QTimer>
+#include <array>
+
+// Measures how responsive the GUI thread is. A fast heartbeat timer records
+// how late each beat fires (the time any input would have waited), and
+// MonitoredApplication times every event it dispatches so long ones can be
+// named. Enabled with --ui-monitor or SCRUTANET_UI_MONITOR=1; the report is
+// logged at exit.
+class UiMonitor : public QObject {
+public:
+    static UiMonitor &instance();
+    static bool isEnabled() { return s_enabled; }
+
+    // Starts the heartbeat on the calling (GUI) thread
+    void start();
+    // Forgets what was recorded so far, e.g. to measure one scenario only
+    void reset();
+
+    // Names the queued call being dispatched, so a slow one is reported by
+    // what it does rather than as an anonymous queued call. Called first
+    // thing in lambdas posted to the GUI thread; site must be a literal.
+    static void nameCall(const char *site);
+
+    // Called by MonitoredApplication for events on the GUI thread that took
+    // longer than a frame, not counting nested event loops they ran
+    void eventBlocked(const QString &what, qint64 us);
+
+    // Heartbeat delay at quantile q (0..1) in milliseconds
+    double latencyMs(double q) const;
+    QString report() const;
+
+private:
+    UiMonitor() = default;
+    void beat();
+
+    struct Offender {
+        int count = 0;
+        qint64 totalUs = 0;
+        qint64 maxUs = 0;
+    };
+
+    static bool s_enabled;
+    QTimer *m_timer = nullptr;
+    QElapsedTimer m_clock;
+    qint64 m_lastBeatUs = 0;
+    // Heartbeat delay in 1 ms buckets, the last one collects everything longer
+    std::array<quint64, 1001> m_histogram{};
+    quint64 m_beats = 0;
+    qint64 m_maxLagUs = 0;
+    int m_stalls = 0;
+    QHash<QString, Offender> m_offenders;
+};
+
+class MonitoredApplication : public QApplication {
+public:
+    MonitoredApplication(int &argc, char **argv) : QApplication(argc, argv) {}
+    bool notify(QObject *receiver, QEvent *event) override;
+
+private:
+    QElapsedTimer m_clock;
+    int m_depth = 0;
+    qint64 m_nestedNs = 0;      // time the current event spent in others, or idle
+    qint64 m_idleSince = -1;
+};
+
+#endif // UIMONITOR_H